@@ -0,0 +1,67 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+#include "async_generator.h"
+
+namespace Generators {
+
+AsyncGenerator::AsyncGenerator(const Model& model, const GeneratorParams& params, TokenCallback on_token, DoneCallback on_done)
+    : generator_{CreateGenerator(model, params)},
+      on_token_{std::move(on_token)},
+      on_done_{std::move(on_done)},
+      reported_length_{static_cast<size_t>(generator_->search_->GetSequenceLength())} {
+}
+
+void AsyncGenerator::Step() {
+  try {
+    if (!cancelled_ && !generator_->IsDone()) {
+      generator_->ComputeLogits();
+      generator_->GenerateNextToken();
+      if (on_token_)
+        ReportTokens();
+
+      // Queue the next step behind the other generations' steps rather than looping here
+      GetWorkerPool().Submit([self = shared_from_this()] { self->Step(); });
+      return;
+    }
+  } catch (...) {
+    Finish(std::current_exception());
+    return;
+  }
+  Finish({});
+}
+
+void AsyncGenerator::ReportTokens() {
+  if (!generator_->speculative_decoder_) {
+    on_token_(generator_->search_->GetNextTokens().GetCPU());
+    return;
+  }
+
+  // A speculative step can append several tokens to its single sequence
+  auto sequence = generator_->GetSequence(0).GetCPU();
+  on_token_(cpu_span<const int32_t>{sequence.data() + reported_length_, sequence.size() - reported_length_});
+  reported_length_ = sequence.size();
+}
+
+void AsyncGenerator::Finish(std::exception_ptr error) {
+  TokenSequences sequences;
+  for (int i = 0; i < generator_->search_->params_->batch_size; i++) {
+    auto sequence = generator_->GetSequence(i).GetCPU();
+    sequences.emplace_back(sequence.begin(), sequence.end());
+  }
+  generator_.reset();  // Free the state before on_done, as the caller may start another generation from it
+
+  if (on_done_)
+    on_done_(sequences, error);
+  done_ = true;
+}
+
+std::shared_ptr<AsyncGenerator> GenerateAsync(const Model& model, const GeneratorParams& params, AsyncGenerator::TokenCallback on_token, AsyncGenerator::DoneCallback on_done) {
+  auto generator = std::make_shared<AsyncGenerator>(model, params, std::move(on_token), std::move(on_done));
+  GetWorkerPool().Submit([generator] { generator->Step(); });
+  return generator;
+}
+
+}  // namespace Generators
@@ -0,0 +1,39 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <atomic>
+#include "worker_pool.h"
+
+namespace Generators {
+
+// Runs a generator on the worker pool, calling on_token with the next tokens of every sequence after each step and
+// on_done once at the end. Each step is its own job so any number of generations share the pool's threads. With
+// speculative decoding there's a single sequence, and on_token gets every token the step appended to it.
+struct AsyncGenerator : std::enable_shared_from_this<AsyncGenerator> {
+  using TokenCallback = std::function<void(cpu_span<const int32_t> next_tokens)>;
+  using DoneCallback = std::function<void(const TokenSequences& sequences, std::exception_ptr error)>;
+
+  AsyncGenerator(const Model& model, const GeneratorParams& params, TokenCallback on_token, DoneCallback on_done);
+
+  void Cancel() { cancelled_ = true; }  // Stops after the current step, on_done still gets called with the sequences so far
+  bool IsDone() const { return done_; }
+
+  std::shared_ptr<AsyncGenerator> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  friend std::shared_ptr<AsyncGenerator> GenerateAsync(const Model& model, const GeneratorParams& params, TokenCallback on_token, DoneCallback on_done);
+  void Step();
+  void ReportTokens();
+  void Finish(std::exception_ptr error);
+
+  std::unique_ptr<Generator> generator_;
+  TokenCallback on_token_;
+  DoneCallback on_done_;
+  size_t reported_length_;  // Length of the sequence passed to on_token so far, used with speculative decoding
+  std::atomic<bool> cancelled_{};
+  std::atomic<bool> done_{};
+};
+
+std::shared_ptr<AsyncGenerator> GenerateAsync(const Model& model, const GeneratorParams& params, AsyncGenerator::TokenCallback on_token, AsyncGenerator::DoneCallback on_done);
+
+}  // namespace Generators
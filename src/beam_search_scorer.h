@@ -5,26 +5,24 @@
 namespace Generators {
 
 struct HypothesisScore {
-  std::span<const int32_t> hypothesis;
+  std::span<const int32_t> Hypothesis() const { return buffer.first(length); }
+
+  std::span<int32_t> buffer;  // max_length sized storage, which moves along with the entry
+  size_t length;
   float score;
 };
 
 struct BeamHypotheses {
   // As these are constructed as an uninitialized array of memory, we need an Init method
+  // Each of the beams must already have its buffer
   void Init(float length_penalty, std::span<HypothesisScore> beams);
 
-  // Add a new hypothesis
+  // Add a new hypothesis, copying it into the storage of a free entry or of the worst one it replaces
   void Add(std::span<const int32_t> hypothesis, float sum_logprobs);
 
   // Return true if this beats the worst score in the hypothesis
   bool CanImprove(float best_sum_logprobs, int current_length) const;
 
-  // Output results
-  void Output(size_t top_k,                              // number of sequences to return
-              size_t max_length,                         // max sequence length
-              std::span<int32_t> sequences,              // buffer with pad token, shape (num_return_sequences, max_length)
-              std::span<float> sequences_scores) const;  // buffer for sequence scores, with shape (num_return_sequences)
-
   std::span<HypothesisScore> beams_;  // Beam width sized array of hypotheses, sorted by highest scoring
   int beams_used_;                    // Number of elements used in beams_
   float length_penalty_;
@@ -34,10 +32,13 @@ struct BeamHypotheses {
 struct BeamSearchScorer {
   BeamSearchScorer(const GeneratorParams& parameters);
 
+  // The candidates are top 2 * group_size for each (batch, group), with indices relative to the group's first beam.
+  // Only the given group of each batch entry is processed, so later groups can see the tokens it picked.
   void Process(Sequences& sequences,
                std::span<const float> next_scores,
                std::span<const int32_t> next_tokens,
-               std::span<const int32_t> next_indices);
+               std::span<const int32_t> next_indices,
+               size_t group = 0);
 
   void Finalize(Sequences& sequences,
                 size_t num_return_sequences,
@@ -45,6 +46,7 @@ struct BeamSearchScorer {
                 cpu_span<float> output_sequence_scores);
 
   bool IsDone() const { return not_done_count_ == 0; }
+  bool IsDone(size_t batch, size_t group) const { return beam_hyps_[batch * num_beam_groups_ + group].done_; }  // Its next tokens are padding from then on
 
   cpu_span<float> GetNextScores() { return next_beam_scores_; }
   cpu_span<int32_t> GetNextTokens() { return next_beam_tokens_; }
@@ -53,11 +55,13 @@ struct BeamSearchScorer {
  private:
   int batch_size_;
   int num_beams_;
+  int num_beam_groups_;
+  int group_size_;  // num_beams_ / num_beam_groups_, the beams of a group are contiguous within the batch entry
   int max_length_;
   int pad_token_id_;
   int eos_token_id_;
   bool early_stopping_;
-  int not_done_count_;  // When zero, every batch entry is done (starts at batch_size_)
+  int not_done_count_;  // When zero, every group of every batch entry is done (starts at batch_size_ * num_beam_groups_)
 
   std::unique_ptr<float[]> next_beam_scores_ptr_;
   cpu_span<float> next_beam_scores_;
@@ -68,13 +72,12 @@ struct BeamSearchScorer {
   std::unique_ptr<int32_t[]> next_beam_indices_ptr_;
   cpu_span<int32_t> next_beam_indices_;
 
-  std::unique_ptr<int32_t[]> hypothesis_buffer_ptr_;  // Allocated buffer to hold all hypotheses
+  std::unique_ptr<int32_t[]> hypothesis_buffer_ptr_;  // max_length_ of storage for each of the num_beams_ * batch_size_ hypotheses
   std::span<int32_t> hypothesis_buffer_;              // Span of the allocated buffer
-  int hypothesis_buffer_used_{};                      // Offset of available buffer, or length of used buffer.
 
-  std::unique_ptr<HypothesisScore[]> hypothesis_scores_ptr_;  // num_beams_ * batch_size_, divided into num_beams_ chunks per BeamHypothesis in beam_hyps_
+  std::unique_ptr<HypothesisScore[]> hypothesis_scores_ptr_;  // num_beams_ * batch_size_, divided into group_size_ chunks per BeamHypothesis in beam_hyps_
   std::unique_ptr<BeamHypotheses[]> beam_hyps_ptr_;
-  std::span<BeamHypotheses> beam_hyps_;  // Shape is batch_size_
+  std::span<BeamHypotheses> beam_hyps_;  // Shape is (batch_size_, num_beam_groups_)
 };
 
 }  // namespace Generators
\ No newline at end of file
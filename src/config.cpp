@@ -169,6 +169,22 @@ struct Outputs_Element : JSON::Element {
   Config::Model::Decoder::Outputs& v_;
 };
 
+struct PrefixCache_Element : JSON::Element {
+  explicit PrefixCache_Element(Config::Model::Decoder::PrefixCache& v) : v_{v} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "max_bytes") {
+      v_.max_bytes = static_cast<size_t>(value);
+    } else if (name == "block_size") {
+      v_.block_size = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::PrefixCache& v_;
+};
+
 struct Decoder_Element : JSON::Element {
   explicit Decoder_Element(Config::Model::Decoder& v) : v_{v} {}
 
@@ -204,6 +220,9 @@ struct Decoder_Element : JSON::Element {
     if (name == "outputs") {
       return outputs_;
     }
+    if (name == "prefix_cache") {
+      return prefix_cache_;
+    }
     throw JSON::unknown_value_error{};
   }
 
@@ -212,6 +231,7 @@ struct Decoder_Element : JSON::Element {
   SessionOptions_Element session_options_{v_.session_options};
   Inputs_Element inputs_{v_.inputs};
   Outputs_Element outputs_{v_.outputs};
+  PrefixCache_Element prefix_cache_{v_.prefix_cache};
 };
 
 struct Eos_Array_Element : JSON::Element {
@@ -303,6 +323,8 @@ struct Search_Element : JSON::Element {
       v_.max_length = static_cast<int>(value);
     } else if (name == "num_beams") {
       v_.num_beams = static_cast<int>(value);
+    } else if (name == "num_beam_groups") {
+      v_.num_beam_groups = static_cast<int>(value);
     } else if (name == "num_return_sequences") {
       v_.num_return_sequences = static_cast<int>(value);
     } else if (name == "top_k") {
@@ -323,6 +345,14 @@ struct Search_Element : JSON::Element {
       v_.length_penalty = static_cast<float>(value);
     } else if (name == "random_seed") {
       v_.random_seed = static_cast<int>(value);
+    } else if (name == "prefill_chunk_size") {
+      v_.prefill_chunk_size = static_cast<int>(value);
+    } else if (name == "num_speculative_tokens") {
+      v_.num_speculative_tokens = static_cast<int>(value);
+    } else if (name == "prompt_lookup_ngram_size") {
+      v_.prompt_lookup_ngram_size = static_cast<int>(value);
+    } else if (name == "num_threads") {
+      v_.num_threads = static_cast<int>(value);
     } else
       throw JSON::unknown_value_error{};
   }
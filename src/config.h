@@ -73,6 +73,11 @@ struct Config {
         std::string cross_present_key_names, cross_present_value_names;
       } outputs;
 
+      struct PrefixCache {
+        size_t max_bytes{};   // Memory budget for cached prompt KV, 0 disables the prefix cache
+        int block_size{16};  // Prompts are matched in whole blocks of this many tokens
+      } prefix_cache;
+
     } decoder;
   } model;
 
@@ -81,6 +86,7 @@ struct Config {
     int min_length{};
     int max_length{};  // If omitted or 0 in json file, will be set to model.context_length on load
     int num_beams{1};  // 1 means no beam search.
+    int num_beam_groups{1};  // Groups the beams are split into for diverse (group) beam search, see diversity_penalty
     int num_return_sequences{1};
     float repetition_penalty{1.0f};  // 1.0 means no penalty.
     int top_k{};                     // Number of highest probability vocabulary tokens to keep for top-k-filtering that will be used by default in the generate method of the model.
@@ -88,10 +94,14 @@ struct Config {
     float temperature{1.0f};
     bool early_stopping{true};  //  Whether to stop the beam search when at least num_beams sentences are finished per batch or not.
     int no_repeat_ngram_size{};
-    float diversity_penalty{};
+    float diversity_penalty{};  // Subtracted from a token's score for each beam of an earlier group that picked it on the same step
     float length_penalty{1.0f};        // Exponential penalty to the length that is used with beam-based generation. length_penalty > 0.0 promotes longer sequences, while length_penalty < 0.0 encourages shorter sequences.
     bool past_present_share_buffer{};  // The past/present kv tensors are shared and allocated once to max_length (cuda only)
     int random_seed{-1};               // -1 = Seed with random device, otherwise use value to seed RNG
+    int prefill_chunk_size{};          // If set, the prompt is run in chunks of at most this many tokens to bound prefill memory
+    int num_speculative_tokens{4};     // Most tokens proposed per step when speculative decoding
+    int prompt_lookup_ngram_size{};    // If set without a draft model, tokens are proposed by matching the last 1 to this many tokens earlier in the sequence
+    int num_threads{1};                // Threads the CPU search splits the rows of a batch across, 0 uses one per core
   } search;
 };
 
@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include <cstdint>
+#include "cpu_features.h"
+#if defined(_MSC_VER) && CPU_X86
+#include <intrin.h>
+#endif
+
+namespace Generators {
+
+namespace {
+
+CpuFeatures DetectCpuFeatures() {
+  CpuFeatures features;
+#if CPU_X86
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+  __cpuid(info, 1);
+  const bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+  const bool fma = (info[2] & (1 << 12)) != 0, f16c = (info[2] & (1 << 29)) != 0;
+  if (!osxsave || !avx)
+    return features;
+  const uint64_t xcr0 = _xgetbv(0);
+  if ((xcr0 & 0x6) != 0x6)  // The OS saves the YMM registers
+    return features;
+  features.f16c = f16c;
+  if (max_leaf < 7)
+    return features;
+  __cpuidex(info, 7, 0);
+  features.avx2 = f16c && fma && (info[1] & (1 << 5)) != 0;
+  features.avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;  // And the ZMM & mask registers
+#else
+  __builtin_cpu_init();
+  features.f16c = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+  features.avx2 = features.f16c && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  features.avx512 = __builtin_cpu_supports("avx512f");
+#endif
+#endif
+  return features;
+}
+
+}  // namespace
+
+const CpuFeatures& GetCpuFeatures() {
+  static const CpuFeatures features = DetectCpuFeatures();
+  return features;
+}
+
+}  // namespace Generators
@@ -0,0 +1,34 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+// Kernels for an instruction set are compiled with a target attribute and picked at runtime from GetCpuFeatures(), so
+// the binary still runs on CPUs without them. MSVC needs no attribute to use the intrinsics.
+#if defined(__x86_64__) || defined(_M_X64)
+#define CPU_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define TARGET_F16C
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_F16C __attribute__((target("avx,f16c")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CPU_ARM64 1  // NEON and its fp16 conversions are part of the ARMv8 baseline, so they need no runtime check
+#include <arm_neon.h>
+#endif
+
+namespace Generators {
+
+struct CpuFeatures {
+  bool f16c{};    // And AVX
+  bool avx2{};    // And FMA & F16C
+  bool avx512{};  // AVX-512F
+};
+
+const CpuFeatures& GetCpuFeatures();
+
+}  // namespace Generators
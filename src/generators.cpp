@@ -5,6 +5,8 @@
 #include "sequences.h"
 #include "models/model.h"
 #include "search.h"
+#include "worker_pool.h"
+#include "speculative.h"
 #if USE_CUDA
 #include "search_cuda.h"
 #endif
@@ -14,6 +16,7 @@ namespace Generators {
 static bool _ = (Ort::InitApi(), false);
 
 OrtGlobals::OrtGlobals() : env_{OrtEnv::Create(OrtLoggingLevel::ORT_LOGGING_LEVEL_ERROR)} {}
+OrtGlobals::~OrtGlobals() = default;
 
 std::unique_ptr<OrtGlobals>& GetOrtGlobals() {
   static auto globals = std::make_unique<OrtGlobals>();
@@ -21,7 +24,14 @@ std::unique_ptr<OrtGlobals>& GetOrtGlobals() {
 }
 
 void Shutdown() {
-  GetOrtGlobals().reset();
+  auto& globals = GetOrtGlobals();
+  if (!globals)
+    return;
+  // Queued jobs look the pool up again (async generations submitting their next step, ParallelFor), so it has to finish
+  // them while the globals are still there
+  if (globals->worker_pool_)
+    globals->worker_pool_->Stop();
+  globals.reset();
 }
 
 OrtEnv& GetOrtEnv() {
@@ -97,15 +107,60 @@ Generator::Generator(const Model& model, const GeneratorParams& params) : model_
   if (params.sequence_length >= params.search.max_length)
     throw std::runtime_error("input sequence_length (" + std::to_string(params.sequence_length) + ") is >= max_length (" + std::to_string(params.search.max_length) + ")");
 
+  if (!params.logits_processors.empty() && params.device_type != DeviceType::CPU)
+    throw std::runtime_error("Logits processors are only supported on the CPU");
+  if (params.search.num_threads < 0)
+    throw std::runtime_error("num_threads must be 0 or greater, is " + std::to_string(params.search.num_threads));
+  if (params.search.num_beam_groups < 1 || params.search.num_beams % params.search.num_beam_groups != 0)
+    throw std::runtime_error("num_beams (" + std::to_string(params.search.num_beams) + ") must be divisible by num_beam_groups (" + std::to_string(params.search.num_beam_groups) + ")");
+  if (params.search.num_beam_groups > 1 && params.device_type != DeviceType::CPU)
+    throw std::runtime_error("Beam groups are only supported on the CPU");
+
+  if (!params.row_search.empty()) {
+    if (params.row_search.size() > static_cast<size_t>(params.batch_size))
+      throw std::runtime_error("row_search has " + std::to_string(params.row_search.size()) + " rows, more than the batch_size (" + std::to_string(params.batch_size) + ")");
+    if (params.device_type != DeviceType::CPU || params.search.num_beams != 1)
+      throw std::runtime_error("Per row search options are only supported by the CPU greedy search");
+    for (auto& row_search : params.row_search) {
+      if (row_search.max_length > params.search.max_length)
+        throw std::runtime_error("A row's max_length (" + std::to_string(row_search.max_length) + ") cannot be greater than the search max_length (" + std::to_string(params.search.max_length) + ")");
+      if (row_search.max_length <= params.sequence_length)
+        throw std::runtime_error("A row's max_length (" + std::to_string(row_search.max_length) + ") must be greater than the input sequence_length (" + std::to_string(params.sequence_length) + ")");
+    }
+  }
+
   search_ = CreateSearch(params);
   state_ = model.CreateState(search_->GetSequenceLengths(), params);
+  if (params.draft_model || params.search.prompt_lookup_ngram_size > 0)
+    speculative_decoder_ = std::make_unique<SpeculativeDecoder>(params);
 }
 
+Generator::~Generator() = default;
+
 void Generator::ComputeLogits() {
   if (computed_logits_)
     throw std::runtime_error("ComputeLogits called again without calling GenerateNextToken first");
 
-  auto logits = state_->Run(search_->GetSequenceLength(), search_->GetNextTokens(), search_->GetNextIndices());
+  // After the prompt, the draft model proposes the tokens and GenerateNextToken() picks from them
+  if (speculative_decoder_ && computed_prompt_ && appended_token_count_ == 0) {
+    speculative_decoder_->ComputeLogits(*state_, search_->GetSequence(0).GetCPU());
+    speculated_ = true;
+    computed_logits_ = true;
+    return;
+  }
+
+  auto logits = [this] {
+    if (appended_token_count_ == 0)
+      return state_->Run(search_->GetSequenceLength(), search_->GetNextTokens(), search_->GetNextIndices());
+
+    // The last generated token was never run through the model, so it goes along with the appended tokens
+    auto sequence = search_->GetSequence(0).GetCPU();
+    const size_t token_count = appended_token_count_ + 1;
+    appended_token_count_ = 0;
+    return state_->RunAppendedTokens(search_->GetSequenceLength(), sequence.subspan(sequence.size() - token_count));
+  }();
+  computed_prompt_ = true;
+
   if (g_log.enabled && g_log.model_logits) {
     auto& stream = Log("model_logits");
     DumpSpan(stream, logits.GetCPU());
@@ -114,9 +169,7 @@ void Generator::ComputeLogits() {
   search_->SetLogits(logits);
   computed_logits_ = true;
 
-  auto& search = search_->params_->search;
-  search_->ApplyMinLength(search.min_length);
-  search_->ApplyRepetitionPenalty(search.repetition_penalty);
+  search_->ProcessLogits();
 }
 
 bool Generator::IsDone() const {
@@ -142,29 +195,68 @@ void Generator::GenerateNextToken() {
            << std::endl;
   }
 
-  if (!search.do_sample || search.top_k == 1) {
-    search_->SelectTop();
+  if (speculated_) {
+    speculated_ = false;
+    auto tokens = speculative_decoder_->SelectTokens(*state_);
+    search_->AppendNextTokens(tokens);
+    return;
+  }
+
+  SelectNextTokens(*search_);
+}
+
+void SelectNextTokens(Search& search) {
+  if (!search.params_->row_search.empty()) {
+    search.SelectPerRow();
+    return;
+  }
+
+  auto& options = search.params_->search;
+
+  if (!options.do_sample || options.top_k == 1) {
+    search.SelectTop();
     return;
   }
 
   // The user explicitly called TopK_TopP on a beam search
-  if (search.num_beams != 1)
+  if (options.num_beams != 1)
     throw std::runtime_error("TopK and TopP cannot be used with a beam search");
 
-  // Sanity checks
-  if (search.top_p < 0.0f || search.top_p > 1.0f)
+  CheckSamplingOptions(options);
+  if (options.top_p > 0.0f && options.top_p < 1.0f && options.top_k > 1) {
+    search.SampleTopKTopP(options.top_k, options.top_p, options.temperature);
+  } else if (options.top_k > 1) {
+    search.SampleTopK(options.top_k, options.temperature);
+  } else {
+    assert(options.top_k == 0);
+    search.SampleTopP(options.top_p, options.temperature);
+  }
+}
+
+void CheckSamplingOptions(const Config::Search& options) {
+  if (options.top_p < 0.0f || options.top_p > 1.0f)
     throw std::runtime_error("top_p must be between 0.0 and 1.0");
-  if (search.top_k < 0)
+  if (options.top_k < 0)
     throw std::runtime_error("top_k must be 0 or greater");
+}
 
-  if (search.top_p > 0.0f && search.top_p < 1.0f && search.top_k > 1) {
-    search_->SampleTopKTopP(search.top_k, search.top_p, search.temperature);
-  } else if (search.top_k > 1) {
-    search_->SampleTopK(search.top_k, search.temperature);
-  } else {
-    assert(search.top_k == 0);
-    search_->SampleTopP(search.top_p, search.temperature);
-  }
+void Generator::AppendTokens(cpu_span<const int32_t> tokens) {
+  auto& params = *search_->params_;
+  if (computed_logits_)
+    throw std::runtime_error("AppendTokens can't be called in the middle of processing logits");
+  if (!computed_prompt_)
+    throw std::runtime_error("AppendTokens must be called after the prompt has been processed by ComputeLogits");
+  if (params.BatchBeamSize() != 1)
+    throw std::runtime_error("AppendTokens is only supported with a batch size of 1 and no beam search");
+  if (params.use_cuda_graph || params.search.past_present_share_buffer)
+    throw std::runtime_error("AppendTokens is not supported with cuda graphs or past_present_share_buffer");
+  if (tokens.empty())
+    return;
+  if (search_->GetSequenceLength() + tokens.size() >= static_cast<size_t>(params.search.max_length))
+    throw std::runtime_error("Appending " + std::to_string(tokens.size()) + " tokens would reach max_length (" + std::to_string(params.search.max_length) + ")");
+
+  search_->AppendTokens(tokens);
+  appended_token_count_ += static_cast<int>(tokens.size());
 }
 
 RoamingArray<int32_t> Generator::GetSequence(int index) const {
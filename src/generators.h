@@ -10,6 +10,7 @@
 #include <iostream>
 #include "span.h"
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <queue>
@@ -39,6 +40,9 @@ namespace Generators {
 struct Model;
 struct State;
 struct Search;
+struct SpeculativeDecoder;
+struct WorkerPool;
+struct LogitsProcessor;
 
 // OgaSequences are a vector of int32 vectors
 using TokenSequences = std::vector<std::vector<int32_t>>;
@@ -55,6 +59,12 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
 
   Config::Search search;
 
+  // Optional search options for each batch row, rows past the end use search. Only the CPU greedy search supports them,
+  // honoring do_sample, min_length, max_length (up to search.max_length), top_k, top_p, temperature,
+  // repetition_penalty and random_seed
+  std::vector<Config::Search> row_search;
+  const Config::Search& GetRowSearch(int row) const { return static_cast<size_t>(row) < row_search.size() ? row_search[row] : search; }
+
   // Read only values copied from model
   int pad_token_id{};
   int eos_token_id{};
@@ -108,6 +118,12 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   // A list of extra model inputs that will be matched at runtime based on name
   std::vector<Input> extra_inputs;
 
+  // If set, this smaller model proposes search.num_speculative_tokens tokens per step for the model to check at once
+  std::shared_ptr<const Model> draft_model;
+
+  // Run in order on every step's logits after the built-in processing, CPU only
+  std::vector<std::shared_ptr<LogitsProcessor>> logits_processors;
+
   void TryGraphCapture(int max_bs);
 
  private:
@@ -116,27 +132,41 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
 
 struct Generator {
   Generator(const Model& model, const GeneratorParams& params);
+  ~Generator();
 
   bool IsDone() const;
   void ComputeLogits();
   void GenerateNextToken();
 
+  // Appends tokens (like the next turn of a chat) to the sequence so generation can continue from it, reusing the KV
+  // cache of everything before. Only supported for a batch size of 1 without beam search, and after the first ComputeLogits()
+  void AppendTokens(cpu_span<const int32_t> tokens);
+
   RoamingArray<int32_t> GetSequence(int index) const;
 
   std::shared_ptr<const Model> model_;
   std::unique_ptr<State> state_;
   std::unique_ptr<Search> search_;
+  std::unique_ptr<SpeculativeDecoder> speculative_decoder_;  // When params.draft_model or search.prompt_lookup_ngram_size is set
   bool computed_logits_{};  // Set to true in ComputeLogits() and false after appending a token to ensure a 1 to 1 call ratio
+  bool computed_prompt_{};  // Set to true once the prompt has been run through the model
+  int appended_token_count_{};  // Tokens added by AppendTokens() that haven't been run through the model yet
+  bool speculated_{};           // Set when ComputeLogits() ran speculative candidates, so GenerateNextToken() picks from them
 };
 
 struct OrtGlobals {
   OrtGlobals();
+  ~OrtGlobals();
 
   std::unique_ptr<OrtEnv> env_;
 #if USE_CUDA
   std::unique_ptr<OrtMemoryInfo> memory_info_cuda_;
   std::unique_ptr<Ort::Allocator> allocator_cuda_;
 #endif
+  // Declared after env_ so it's destroyed (finishing queued async generations) before the environment
+  std::unique_ptr<WorkerPool> worker_pool_;
+  std::once_flag worker_pool_created_;
+
  private:
   OrtGlobals(const OrtGlobals&) = delete;
   void operator=(const OrtGlobals&) = delete;
@@ -152,6 +182,10 @@ std::shared_ptr<GeneratorParams> CreateGeneratorParams();  // For benchmarking p
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params);
 std::vector<std::vector<int32_t>> Generate(const Model& model, const GeneratorParams& params);  // Uses CreateGenerator and a simple loop to return the entire sequence
 
+std::unique_ptr<Search> CreateSearch(const GeneratorParams& params);
+void SelectNextTokens(Search& search);  // Picks the next tokens from the search's logits using its search params (argmax or sampling)
+void CheckSamplingOptions(const Config::Search& options);  // Throws if top_k or top_p are out of range
+
 float Float16ToFloat32(uint16_t v);  // v is a IEEE 752-2008 binary16 format, 1 sign bit, 5 bit exponent, 10 bit fraction
 void top_k_indices(std::span<int32_t> top_k, std::span<const float> inputs);
 
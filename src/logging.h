@@ -21,6 +21,9 @@
  *
  *        "warning" messages will appear in yellow, there is a special case in the Log(...) function for this
  *        There is no red for errors, as errors are exceptions.
+ *
+ * THREADS: The options are global and not synchronized, so set them before generators run on other threads. Log entries
+ *          from concurrent generators can interleave.
  */
 namespace Generators {
 
@@ -0,0 +1,18 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// A user stage of the logits processing, run after the built-in min_length, repetition_penalty and
+// no_repeat_ngram_size processing and before the search picks the next tokens. The CPU search runs every stage on a
+// row before moving to the next row, so a row is read from memory once however many stages there are.
+struct LogitsProcessor {
+  virtual ~LogitsProcessor() = default;
+
+  // Adjusts the scores of one batch_beam row, given that row's sequence so far. Different rows can be processed at the
+  // same time on different threads when search.num_threads isn't 1.
+  virtual void Process(int row, std::span<const int32_t> sequence, std::span<float> scores) = 0;
+};
+
+}  // namespace Generators
@@ -28,7 +28,7 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
     return nullptr;
   }
 
-  // Multiple generators can reserve graphs in parallel, so we need to make it thread saf
+  // Multiple generators can reserve graphs in parallel, so we need to make it thread safe
   std::unique_lock lock(captured_graph_mutex_);
 
   auto key = MakeKey(params.max_batch_size, params.search.max_length, params.search.num_beams);
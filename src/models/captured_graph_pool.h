@@ -36,6 +36,8 @@ struct CapturedGraphInfoRecycler {
 
 using CapturedGraphInfoPtr = std::unique_ptr<CapturedGraphInfo, CapturedGraphInfoRecycler>;
 
+// Shared by every generator of a model, so all access to the pool goes through captured_graph_mutex_. A reserved
+// CapturedGraphInfo is owned by a single generator until it's returned to the pool.
 class CapturedGraphPool : public std::enable_shared_from_this<CapturedGraphPool> {
  public:
   CapturedGraphPool(const Config* config, const SessionInfo* session_info, Ort::Allocator* allocator_device)
@@ -0,0 +1,344 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "../search.h"
+#include "model.h"
+#include "gpt.h"
+#include "decoder_only.h"
+#include "continuous_batch.h"
+
+namespace Generators {
+
+struct ContinuousBatch::Request {
+  std::shared_ptr<const GeneratorParams> params;
+  std::unique_ptr<Search> search;
+  KV_BlockTable kv;
+  int64_t past_row{-1};  // Row of ContinuousBatch::pasts_ holding this request's KV, if it was in the last decode step
+  bool prefilled{};
+};
+
+namespace {
+
+OrtSession& GetDecoderSession(const Model& model) {
+  if (auto* decoder_only = dynamic_cast<const DecoderOnly_Model*>(&model))
+    return *decoder_only->session_decoder_;
+  if (auto* gpt = dynamic_cast<const Gpt_Model*>(&model))
+    return *gpt->session_decoder_;
+  throw std::runtime_error("Continuous batching is only supported for decoder only models");
+}
+
+std::unique_ptr<OrtValue> CreateIntTensor(OrtAllocator& allocator, std::span<const int64_t> shape, ONNXTensorElementDataType type, std::span<const int64_t> values) {
+  auto value = OrtValue::CreateTensor(allocator, shape, type);
+  if (type == Ort::TypeToTensorType<int64_t>::type)
+    std::copy(values.begin(), values.end(), value->GetTensorMutableData<int64_t>());
+  else
+    std::transform(values.begin(), values.end(), value->GetTensorMutableData<int32_t>(), [](int64_t v) { return static_cast<int32_t>(v); });
+  return value;
+}
+
+}  // namespace
+
+ContinuousBatch::ContinuousBatch(const Model& model, int kv_block_count, int kv_block_size)
+    : State{*CreateGeneratorParams(model)},
+      model_{model},
+      session_{GetDecoderSession(model)},
+      layer_count_{model.config_->model.decoder.num_hidden_layers},
+      combined_kv_{!model.config_->model.decoder.inputs.past_names.empty()} {
+  if (model_.device_type_ != DeviceType::CPU)
+    throw std::runtime_error("Continuous batching currently only supports the CPU device");
+
+  auto& decoder = model_.config_->model.decoder;
+  for (int i = 0; i < layer_count_; ++i) {
+    char string[64];
+    if (combined_kv_) {
+      snprintf(string, std::size(string), decoder.inputs.past_names.c_str(), i);
+      input_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), decoder.outputs.present_names.c_str(), i);
+      output_name_strings_.emplace_back(string);
+    } else {
+      snprintf(string, std::size(string), decoder.inputs.past_key_names.c_str(), i);
+      input_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), decoder.inputs.past_value_names.c_str(), i);
+      input_name_strings_.emplace_back(string);
+
+      snprintf(string, std::size(string), decoder.outputs.present_key_names.c_str(), i);
+      output_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), decoder.outputs.present_value_names.c_str(), i);
+      output_name_strings_.emplace_back(string);
+    }
+  }
+
+  if (combined_kv_) {
+    kv_shape_ = {2, 0, decoder.num_key_value_heads, 0, decoder.head_size};
+    kv_batch_axis_ = 1;
+    kv_seq_axis_ = 3;
+  } else {
+    kv_shape_ = {0, decoder.num_key_value_heads, 0, decoder.head_size};
+    kv_batch_axis_ = 0;
+    kv_seq_axis_ = 2;
+  }
+
+  kv_type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
+  input_ids_type_ = model_.session_info_->GetInputDataType(decoder.inputs.input_ids);
+  logits_type_ = model_.session_info_->GetOutputDataType(decoder.outputs.logits);
+  has_mask_input_ = model_.session_info_->HasInput(decoder.inputs.attention_mask);
+  has_posid_input_ = model_.session_info_->HasInput(decoder.inputs.position_ids);
+  position_type_ = has_mask_input_ ? model_.session_info_->GetInputDataType(decoder.inputs.attention_mask)
+                                   : Ort::TypeToTensorType<int32_t>::type;
+  if (has_posid_input_)
+    position_type_ = model_.session_info_->GetInputDataType(decoder.inputs.position_ids);
+
+  kv_cache_ = std::make_unique<PagedKV_Cache>(model_, input_name_strings_.size(), kv_shape_, kv_batch_axis_, kv_type_, kv_block_count, kv_block_size);
+
+  // Sized to grow up to what the whole KV cache holds, larger batches can still go past that
+  size_t token_bytes = SizeOf(kv_type_);
+  for (auto dim : kv_shape_)
+    token_bytes *= std::max<int64_t>(dim, 1);
+  buffers_.emplace(model_, input_name_strings_.size(), token_bytes * kv_block_count * kv_block_size);
+}
+
+ContinuousBatch::~ContinuousBatch() = default;
+
+int ContinuousBatch::AddRequest(const GeneratorParams& params) {
+  if (params.batch_size != 1)
+    throw std::runtime_error("Continuous batching requests must have a batch_size of 1, is " + std::to_string(params.batch_size));
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("Continuous batching does not support beam search");
+  if (params.search.max_length > model_.config_->model.context_length)
+    throw std::runtime_error("max_length (" + std::to_string(params.search.max_length) + ") cannot be greater than model context_length (" + std::to_string(model_.config_->model.context_length) + ")");
+  if (params.sequence_length >= params.search.max_length)
+    throw std::runtime_error("input sequence_length (" + std::to_string(params.sequence_length) + ") is >= max_length (" + std::to_string(params.search.max_length) + ")");
+
+  auto request = std::make_unique<Request>();
+  request->params = params.shared_from_this();
+  request->search = CreateSearch(params);
+
+  int request_id = next_request_id_++;
+  requests_.emplace(request_id, std::move(request));
+  return request_id;
+}
+
+void ContinuousBatch::RemoveRequest(int request_id) {
+  auto it = requests_.find(request_id);
+  if (it == requests_.end())
+    throw std::runtime_error("Unknown continuous batching request id " + std::to_string(request_id));
+  kv_cache_->Release(it->second->kv);
+  requests_.erase(it);
+}
+
+bool ContinuousBatch::IsDone(int request_id) const {
+  auto it = requests_.find(request_id);
+  if (it == requests_.end())
+    throw std::runtime_error("Unknown continuous batching request id " + std::to_string(request_id));
+  return it->second->search->IsDone();
+}
+
+RoamingArray<int32_t> ContinuousBatch::GetSequence(int request_id) const {
+  auto it = requests_.find(request_id);
+  if (it == requests_.end())
+    throw std::runtime_error("Unknown continuous batching request id " + std::to_string(request_id));
+  return it->second->search->GetSequence(0);
+}
+
+size_t ContinuousBatch::GetLiveRequestCount() const {
+  return std::count_if(requests_.begin(), requests_.end(), [](auto& v) { return !v.second->search->IsDone(); });
+}
+
+RoamingArray<float> ContinuousBatch::Run(int /*current_length*/, RoamingArray<int32_t> /*next_tokens*/, RoamingArray<int32_t> /*next_indices*/) {
+  throw std::runtime_error("ContinuousBatch is driven through Step()");
+}
+
+void ContinuousBatch::Step() {
+  // Requests that joined since the last step are prefilled on their own, every other live request decodes together.
+  // A request prefilled here already has its next token, so it joins the batched decode on the next step.
+  std::vector<Request*> decode_requests;
+  for (auto& [request_id, request] : requests_) {
+    if (!request->prefilled)
+      Prefill(*request);
+    else if (!request->search->IsDone())
+      decode_requests.push_back(request.get());
+  }
+
+  if (!decode_requests.empty())
+    Decode(decode_requests);
+}
+
+void ContinuousBatch::BindOutputs(int64_t batch_size, int64_t past_length, int64_t sequence_length) {
+  auto& allocator = model_.allocator_cpu_;
+  auto& decoder = model_.config_->model.decoder;
+
+  auto logits_shape = std::array<int64_t, 3>{batch_size, sequence_length, params_->vocab_size};
+  logits_ = OrtValue::CreateTensor(allocator, logits_shape, logits_type_);
+  outputs_.push_back(logits_.get());
+  output_names_.push_back(decoder.outputs.logits.c_str());
+
+  auto kv_shape = kv_shape_;
+  kv_shape[kv_batch_axis_] = batch_size;
+  kv_shape[kv_seq_axis_] = past_length + sequence_length;
+  presents_.resize(output_name_strings_.size());
+  for (size_t i = 0; i < presents_.size(); i++) {
+    presents_[i] = buffers_->CreatePresent(i, i < pasts_.size() ? pasts_[i].get() : nullptr, kv_shape, kv_type_);
+    outputs_.push_back(presents_[i].get());
+    output_names_.push_back(output_name_strings_[i].c_str());
+  }
+}
+
+void ContinuousBatch::Prefill(Request& request) {
+  auto& allocator = model_.allocator_cpu_;
+  auto& decoder = model_.config_->model.decoder;
+
+  // A single request has no need for padding, so any pad tokens are dropped from the model inputs
+  std::vector<int64_t> tokens;
+  for (auto token : request.params->input_ids) {
+    if (token != request.params->pad_token_id)
+      tokens.push_back(token);
+  }
+  if (tokens.empty())
+    throw std::runtime_error("Continuous batching request has no input tokens");
+
+  const int64_t length = static_cast<int64_t>(tokens.size());
+  auto shape = std::array<int64_t, 2>{1, length};
+
+  ClearIO();
+  input_ids_ = CreateIntTensor(allocator, shape, input_ids_type_, tokens);
+  inputs_.push_back(input_ids_.get());
+  input_names_.push_back(decoder.inputs.input_ids.c_str());
+
+  if (has_posid_input_) {
+    std::vector<int64_t> positions(length);
+    std::iota(positions.begin(), positions.end(), int64_t{0});
+    position_ids_ = CreateIntTensor(allocator, shape, position_type_, positions);
+    inputs_.push_back(position_ids_.get());
+    input_names_.push_back(decoder.inputs.position_ids.c_str());
+  }
+
+  if (has_mask_input_) {
+    std::vector<int64_t> mask(length, 1);
+    attention_mask_ = CreateIntTensor(allocator, shape, position_type_, mask);
+    inputs_.push_back(attention_mask_.get());
+    input_names_.push_back(decoder.inputs.attention_mask.c_str());
+  }
+
+  auto empty_shape = kv_shape_;
+  empty_shape[kv_batch_axis_] = 1;
+  auto empty_past = OrtValue::CreateTensor(allocator, empty_shape, kv_type_);
+  for (auto& name : input_name_strings_) {
+    inputs_.push_back(empty_past.get());
+    input_names_.push_back(name.c_str());
+  }
+
+  kv_cache_->Reserve(request.kv, static_cast<int>(length));
+  BindOutputs(1, 0, length);
+  State::Run(session_, *run_options_);
+
+  for (size_t i = 0; i < presents_.size(); i++)
+    kv_cache_->Write(request.kv, i, *presents_[i], 0, 0, static_cast<int>(length));
+  request.kv.length = static_cast<int>(length);
+  request.prefilled = true;
+
+  if (logits_type_ != Ort::TypeToTensorType<float>::type)
+    ConvertFp16ToFp32(allocator, *logits_, logits32_, model_.device_type_, model_.cuda_stream_);
+  else
+    logits32_ = std::move(logits_);
+
+  auto logits = std::span<float>(logits32_->GetTensorMutableData<float>(), length * params_->vocab_size);
+  ComputeNextToken(request, logits.subspan((length - 1) * params_->vocab_size, params_->vocab_size));
+}
+
+void ContinuousBatch::Decode(std::span<Request*> requests) {
+  auto& allocator = model_.allocator_cpu_;
+  auto& decoder = model_.config_->model.decoder;
+
+  const int64_t batch_size = static_cast<int64_t>(requests.size());
+  int64_t past_length = 0;
+  for (auto* request : requests)
+    past_length = std::max<int64_t>(past_length, request->kv.length);
+
+  ClearIO();
+
+  std::vector<int64_t> values(batch_size);
+  auto shape = std::array<int64_t, 2>{batch_size, 1};
+  for (int64_t i = 0; i < batch_size; i++)
+    values[i] = requests[i]->search->GetNextTokens().GetCPU()[0];
+  input_ids_ = CreateIntTensor(allocator, shape, input_ids_type_, values);
+  inputs_.push_back(input_ids_.get());
+  input_names_.push_back(decoder.inputs.input_ids.c_str());
+
+  if (has_posid_input_) {
+    for (int64_t i = 0; i < batch_size; i++)
+      values[i] = requests[i]->kv.length;
+    position_ids_ = CreateIntTensor(allocator, shape, position_type_, values);
+    inputs_.push_back(position_ids_.get());
+    input_names_.push_back(decoder.inputs.position_ids.c_str());
+  }
+
+  // Shorter requests are left padded up to the longest one, the padding is masked out
+  if (has_mask_input_) {
+    std::vector<int64_t> mask(batch_size * (past_length + 1), 1);
+    for (int64_t i = 0; i < batch_size; i++)
+      std::fill_n(mask.begin() + i * (past_length + 1), past_length - requests[i]->kv.length, 0);
+    attention_mask_ = CreateIntTensor(allocator, std::array<int64_t, 2>{batch_size, past_length + 1}, position_type_, mask);
+    inputs_.push_back(attention_mask_.get());
+    input_names_.push_back(decoder.inputs.attention_mask.c_str());
+  }
+
+  // Reserve before running, so running out of blocks throws before any request has been advanced
+  for (auto* request : requests)
+    kv_cache_->Reserve(request->kv, request->kv.length + 1);
+
+  // When the batch is the same size and the longest request grew by one token, every request decoded last step kept
+  // its padding, so its row of the last presents is still valid. Otherwise the layout changed and every row is gathered
+  bool same_layout = !pasts_.empty();
+  if (same_layout) {
+    auto last_shape = pasts_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+    same_layout = last_shape[kv_batch_axis_] == batch_size && last_shape[kv_seq_axis_] == past_length;
+  }
+
+  auto kv_shape = kv_shape_;
+  kv_shape[kv_batch_axis_] = batch_size;
+  kv_shape[kv_seq_axis_] = past_length;
+  pasts_.resize(input_name_strings_.size());
+  for (size_t i = 0; i < pasts_.size(); i++) {
+    if (!same_layout)
+      pasts_[i] = buffers_->CreatePresent(i, pasts_[i].get(), kv_shape, kv_type_);
+
+    for (int64_t b = 0; b < batch_size; b++) {
+      if (!same_layout || requests[b]->past_row != b)
+        kv_cache_->Gather(requests[b]->kv, i, *pasts_[i], b, past_length - requests[b]->kv.length);
+    }
+
+    inputs_.push_back(pasts_[i].get());
+    input_names_.push_back(input_name_strings_[i].c_str());
+  }
+
+  BindOutputs(batch_size, past_length, 1);
+  State::Run(session_, *run_options_);
+
+  // Only the new token of each request is written back, it's the last entry of the presents
+  for (int64_t b = 0; b < batch_size; b++) {
+    auto& request = *requests[b];
+    for (size_t i = 0; i < presents_.size(); i++)
+      kv_cache_->Write(request.kv, i, *presents_[i], b, past_length, 1);
+    request.kv.length++;
+    request.past_row = b;
+  }
+  std::swap(pasts_, presents_);
+
+  if (logits_type_ != Ort::TypeToTensorType<float>::type)
+    ConvertFp16ToFp32(allocator, *logits_, logits32_, model_.device_type_, model_.cuda_stream_);
+  else
+    logits32_ = std::move(logits_);
+
+  auto logits = std::span<float>(logits32_->GetTensorMutableData<float>(), batch_size * params_->vocab_size);
+  for (int64_t b = 0; b < batch_size; b++)
+    ComputeNextToken(*requests[b], logits.subspan(b * params_->vocab_size, params_->vocab_size));
+}
+
+void ContinuousBatch::ComputeNextToken(Request& request, std::span<float> logits) {
+  auto& search = *request.search;
+  search.SetLogits(cpu_span<float>{logits.data(), logits.size()});
+  search.ProcessLogits();
+  SelectNextTokens(search);
+}
+
+}  // namespace Generators
@@ -0,0 +1,72 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <map>
+#include "model.h"
+#include "kv_cache.h"
+#include "paged_kv_cache.h"
+
+namespace Generators {
+
+struct Search;
+
+// Runs many independent requests through a single decoder session, where requests can join and leave the running
+// batch between steps. Each request is a batch_size 1 GeneratorParams with its own search settings and keeps its KV
+// cache in blocks of a shared PagedKV_Cache, so a step only writes the new token of each request. A newly added
+// request is prefilled on its own by the next Step(), after which every live request shares one batched decode run
+// per Step(). Shorter requests are left padded and masked out. The presents of a decode step are the pasts of the next
+// one, so only rows whose request or padding changed are gathered from the KV cache again.
+struct ContinuousBatch : State {
+  // The KV cache holds kv_block_count * kv_block_size tokens, shared by all requests
+  ContinuousBatch(const Model& model, int kv_block_count = 1024, int kv_block_size = 16);
+  ~ContinuousBatch();
+
+  // Returns an id used to refer to the request in the calls below. The request is prefilled on the next Step()
+  int AddRequest(const GeneratorParams& params);
+  void RemoveRequest(int request_id);  // Can be called for both live and done requests
+
+  bool IsDone(int request_id) const;
+  RoamingArray<int32_t> GetSequence(int request_id) const;
+
+  size_t GetRequestCount() const { return requests_.size(); }
+  size_t GetLiveRequestCount() const;  // Requests that are not done yet
+  size_t GetFreeKVBlockCount() const { return kv_cache_->GetFreeBlockCount(); }
+
+  void Step();  // Computes the next token for every live request
+
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+ private:
+  struct Request;
+
+  void Prefill(Request& request);
+  void Decode(std::span<Request*> requests);
+  void BindOutputs(int64_t batch_size, int64_t past_length, int64_t sequence_length);
+  void ComputeNextToken(Request& request, std::span<float> logits);
+
+  const Model& model_;
+  OrtSession& session_;
+
+  int layer_count_;
+  bool combined_kv_;                   // True when key & value are combined into a single past_%d tensor (gpt2 style)
+  std::vector<int64_t> kv_shape_;      // Shape of one request's KV, with 0 in the batch & sequence dimensions
+  size_t kv_batch_axis_, kv_seq_axis_;  // Indices into kv_shape_
+  ONNXTensorElementDataType kv_type_;
+  ONNXTensorElementDataType input_ids_type_;
+  ONNXTensorElementDataType logits_type_;
+  ONNXTensorElementDataType position_type_;  // Common type for position_ids and attention_mask
+  bool has_mask_input_{}, has_posid_input_{};
+  std::vector<std::string> input_name_strings_, output_name_strings_;
+
+  int next_request_id_{};
+  std::map<int, std::unique_ptr<Request>> requests_;  // Ordered, so rows keep a stable order in the batch
+
+  // Per step tensors, the run inputs_ and outputs_ point into these
+  std::unique_ptr<OrtValue> input_ids_, position_ids_, attention_mask_, logits_, logits32_;
+  std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;  // pasts_ holds the last decode step's presents
+  std::optional<KV_Buffers> buffers_;                        // Where pasts_ & presents_ live, grown as needed
+
+  std::unique_ptr<PagedKV_Cache> kv_cache_;
+};
+
+}  // namespace Generators
@@ -22,19 +22,34 @@ DecoderOnly_State::DecoderOnly_State(const DecoderOnly_Model& model, RoamingArra
   position_inputs_.Add();
   logits_.Add();
   kv_cache_.Add();
+
+  use_prefix_cache_ = model_.prefix_cache_ && PrefixCache::IsSupported(model_, params);
 }
 
 RoamingArray<float> DecoderOnly_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   if (first_run_) {
     if (params_->use_cuda_graph) {
-      model_.run_options_->AddConfigEntry("gpu_graph_id", "-1");
+      run_options_->AddConfigEntry("gpu_graph_id", "-1");
+    }
+    int prompt_start = use_prefix_cache_ ? SkipCachedPrefix(model_, kv_cache_) : 0;
+    if (prefill_chunk_size_)
+      prompt_start = RunPrefillChunks(*model_.session_decoder_, prompt_start, prefill_chunk_size_, input_ids_, position_inputs_, kv_cache_, logits_.GetOutputIndex());
+    if (prompt_start != 0 || prefill_chunk_size_) {
+      input_ids_.SetPromptRange(prompt_start, params_->sequence_length);
+      position_inputs_.SetPromptRange(prompt_start, params_->sequence_length);
+      logits_.SkipPrefix(prompt_start);
     }
     first_run_ = false;
   } else {
     UpdateInputs(next_tokens, next_indices, current_length);
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_);
+  State::Run(*model_.session_decoder_, *run_options_);
+
+  if (use_prefix_cache_) {
+    model_.prefix_cache_->Insert(params_->input_ids, kv_cache_.GetPresents(), model_.allocator_cpu_);
+    use_prefix_cache_ = false;  // Only the prompt is cached
+  }
 
   // Set the graph id for the following runs.
   if (params_->use_cuda_graph) {
@@ -42,12 +57,33 @@ RoamingArray<float> DecoderOnly_State::Run(int current_length, RoamingArray<int3
     if (new_batch_size != current_batch_size_) {
       current_batch_size_ = new_batch_size;
       auto annotation_id = std::to_string(captured_graph_info_->GenerateUniqueAnnotationID(new_batch_size));
-      model_.run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
+      run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
     }
   }
   return logits_.Get();
 }
 
+RoamingArray<float> DecoderOnly_State::RunAppendedTokens(int current_length, cpu_span<const int32_t> tokens) {
+  RunTokens(current_length, tokens);
+  return logits_.Get();
+}
+
+RoamingArray<float> DecoderOnly_State::RunCandidateTokens(int current_length, cpu_span<const int32_t> tokens) {
+  RunTokens(current_length, tokens);
+  return logits_.GetAll();
+}
+
+void DecoderOnly_State::RunTokens(int current_length, cpu_span<const int32_t> tokens) {
+  assert(!first_run_);
+  const int token_count = static_cast<int>(tokens.size());
+  input_ids_.Append(tokens);
+  position_inputs_.Append(current_length, token_count);
+  logits_.Append(token_count);
+  kv_cache_.Update({}, current_length);
+
+  State::Run(*model_.session_decoder_, *run_options_);
+}
+
 void DecoderOnly_State::UpdateInputs(const RoamingArray<int32_t>& next_tokens_unk, RoamingArray<int32_t> beam_indices, int current_length) {
   input_ids_.Update(next_tokens_unk);
   position_inputs_.Update(current_length);
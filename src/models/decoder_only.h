@@ -18,18 +18,24 @@ struct DecoderOnly_Model : Model {
 struct DecoderOnly_State : State {
   DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+  RoamingArray<float> RunAppendedTokens(int current_length, cpu_span<const int32_t> tokens) override;
+  RoamingArray<float> RunCandidateTokens(int current_length, cpu_span<const int32_t> tokens) override;
+  void Rewind(int length) override { kv_cache_.Rewind(length); }
   const CapturedGraphInfo* GetCapturedGraphInfo() const override { return captured_graph_info_.get(); };
 
  private:
   void UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> next_indices, int current_length);
+  void RunTokens(int current_length, cpu_span<const int32_t> tokens);
 
   const DecoderOnly_Model& model_;
   CapturedGraphInfoPtr captured_graph_info_;
   bool first_run_{true};
+  bool use_prefix_cache_{};
+  int prefill_chunk_size_{GetPrefillChunkSize(*params_)};
   int current_batch_size_{0};
 
   InputIDs input_ids_{model_, *this};
-  Logits logits_{model_, *this};
+  Logits logits_{model_, *this, prefill_chunk_size_ != 0};
   KV_Cache kv_cache_{model_, *this};
   PositionInputs position_inputs_;
 };
@@ -21,19 +21,55 @@ Gpt_State::Gpt_State(const Gpt_Model& model, RoamingArray<int32_t> sequence_leng
   position_inputs_.Add();
   logits_.Add();
   kv_cache_.Add();
+
+  use_prefix_cache_ = model_.prefix_cache_ && PrefixCache::IsSupported(model_, params);
 }
 
 RoamingArray<float> Gpt_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   if (first_run_) {
+    int prompt_start = use_prefix_cache_ ? SkipCachedPrefix(model_, kv_cache_) : 0;
+    if (prefill_chunk_size_)
+      prompt_start = RunPrefillChunks(*model_.session_decoder_, prompt_start, prefill_chunk_size_, input_ids_, position_inputs_, kv_cache_, logits_.GetOutputIndex());
+    if (prompt_start != 0 || prefill_chunk_size_) {
+      input_ids_.SetPromptRange(prompt_start, params_->sequence_length);
+      position_inputs_.SetPromptRange(prompt_start, params_->sequence_length);
+      logits_.SkipPrefix(prompt_start);
+    }
     first_run_ = false;
   } else {
     UpdateInputs(next_tokens, next_indices, current_length);
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_);
+  State::Run(*model_.session_decoder_, *run_options_);
+
+  if (use_prefix_cache_) {
+    model_.prefix_cache_->Insert(params_->input_ids, kv_cache_.GetPresents(), model_.allocator_cpu_);
+    use_prefix_cache_ = false;  // Only the prompt is cached
+  }
+  return logits_.Get();
+}
+
+RoamingArray<float> Gpt_State::RunAppendedTokens(int current_length, cpu_span<const int32_t> tokens) {
+  RunTokens(current_length, tokens);
   return logits_.Get();
 }
 
+RoamingArray<float> Gpt_State::RunCandidateTokens(int current_length, cpu_span<const int32_t> tokens) {
+  RunTokens(current_length, tokens);
+  return logits_.GetAll();
+}
+
+void Gpt_State::RunTokens(int current_length, cpu_span<const int32_t> tokens) {
+  assert(!first_run_);
+  const int token_count = static_cast<int>(tokens.size());
+  input_ids_.Append(tokens);
+  position_inputs_.Append(current_length, token_count);
+  logits_.Append(token_count);
+  kv_cache_.Update({}, current_length);
+
+  State::Run(*model_.session_decoder_, *run_options_);
+}
+
 void Gpt_State::UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length) {
   input_ids_.Update(next_tokens);
   position_inputs_.Update(current_length);
@@ -18,15 +18,21 @@ struct Gpt_Model : Model {
 struct Gpt_State : State {
   Gpt_State(const Gpt_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+  RoamingArray<float> RunAppendedTokens(int current_length, cpu_span<const int32_t> tokens) override;
+  RoamingArray<float> RunCandidateTokens(int current_length, cpu_span<const int32_t> tokens) override;
+  void Rewind(int length) override { kv_cache_.Rewind(length); }
 
  private:
   void UpdateInputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length);
+  void RunTokens(int current_length, cpu_span<const int32_t> tokens);
 
   const Gpt_Model& model_;
   bool first_run_{true};
+  bool use_prefix_cache_{};
+  int prefill_chunk_size_{GetPrefillChunkSize(*params_)};
 
   InputIDs input_ids_{model_, *this};
-  Logits logits_{model_, *this};
+  Logits logits_{model_, *this, prefill_chunk_size_ != 0};
   KV_Cache_Combined kv_cache_{model_, *this};
   PositionInputs position_inputs_;
 };
@@ -46,6 +46,38 @@ void InputIDs::Add() {
   state_.input_names_.push_back(name_);
 }
 
+void InputIDs::SetPromptRange(int start, int end) {
+  auto& params = *state_.params_;
+  shape_ = {params.batch_size, end - start};
+
+  auto value = OrtValue::CreateTensor(model_.allocator_cpu_, shape_, type_);
+  for (int i = 0; i < params.batch_size; i++) {
+    auto input_ids = params.input_ids.subspan(i * params.sequence_length + start, shape_[1]);
+    if (type_ == Ort::TypeToTensorType<int64_t>::type)
+      std::copy(input_ids.begin(), input_ids.end(), value->GetTensorMutableData<int64_t>() + i * shape_[1]);
+    else
+      std::copy(input_ids.begin(), input_ids.end(), value->GetTensorMutableData<int32_t>() + i * shape_[1]);
+  }
+
+  value_ = model_.ExpandInputs(value, params.search.num_beams);
+  shape_[0] *= params.search.num_beams;
+  state_.inputs_[input_index_] = value_.get();
+}
+
+void InputIDs::Append(cpu_span<const int32_t> tokens) {
+  assert(shape_[0] == 1 && !sb_input_ids_);
+  shape_[1] = static_cast<int64_t>(tokens.size());
+
+  auto value = OrtValue::CreateTensor(model_.allocator_cpu_, shape_, type_);
+  if (type_ == Ort::TypeToTensorType<int64_t>::type)
+    std::copy(tokens.begin(), tokens.end(), value->GetTensorMutableData<int64_t>());
+  else
+    std::copy(tokens.begin(), tokens.end(), value->GetTensorMutableData<int32_t>());
+
+  value_ = model_.ExpandInputs(value, 1);
+  state_.inputs_[input_index_] = value_.get();
+}
+
 void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
   // Resize input_ids shape once if it doesn't match the decoder shape
   if (shape_[1] != 1) {
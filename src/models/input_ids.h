@@ -9,6 +9,8 @@ struct InputIDs {
 
   void Add();
   void Update(RoamingArray<int32_t> next_tokens);
+  void SetPromptRange(int start, int end);  // Only run prompt tokens [start, end), for when the KV of earlier tokens is already known
+  void Append(cpu_span<const int32_t> tokens);  // Run several tokens of a single sequence, see Generator::AppendTokens
 
   auto& GetShape() const { return shape_; }
   const char* name_;
@@ -4,6 +4,105 @@
 
 namespace Generators {
 
+std::unique_ptr<OrtValue> SliceSequence(const OrtValue& source, int64_t length, OrtAllocator& allocator) {
+  auto type_info = source.GetTensorTypeAndShapeInfo();
+  auto shape = type_info->GetShape();
+  const size_t seq_axis = shape.size() - 2;
+  const int64_t source_length = shape[seq_axis];
+  assert(length <= source_length);
+
+  const size_t token_bytes = shape.back() * SizeOf(type_info->GetElementType());
+  int64_t row_count = 1;
+  for (size_t i = 0; i < seq_axis; i++)
+    row_count *= shape[i];
+
+  shape[seq_axis] = length;
+  auto target = OrtValue::CreateTensor(allocator, shape, type_info->GetElementType());
+
+  auto* source_data = static_cast<const uint8_t*>(source.GetTensorRawData());
+  auto* target_data = static_cast<uint8_t*>(target->GetTensorMutableRawData());
+  for (int64_t row = 0; row < row_count; row++)
+    std::memcpy(target_data + row * length * token_bytes, source_data + row * source_length * token_bytes, length * token_bytes);
+  return target;
+}
+
+KV_Buffers::KV_Buffers(const Model& model, size_t tensor_count, size_t max_bytes)
+    : model_{model},
+      max_bytes_{max_bytes},
+      buffers_(tensor_count) {
+}
+
+uint8_t* KV_Buffers::Reserve(Buffer& buffer, size_t bytes) {
+  if (bytes > buffer.bytes) {
+    buffer.data.reset();  // Free the old one first, its contents aren't needed
+    buffer.bytes = std::max(bytes, std::min(buffer.bytes * 2, max_bytes_));
+    auto& allocator = *model_.allocator_device_;
+    buffer.data = Ort::IAllocatorUniquePtr<uint8_t>(static_cast<uint8_t*>(allocator.Alloc(buffer.bytes)), Ort::AllocatorDeleter(&allocator));
+  }
+  return buffer.data.get();
+}
+
+void KV_Buffers::CopyBytes(uint8_t* target, const uint8_t* source, size_t bytes) {
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    cudaMemcpyAsync(target, source, bytes, cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+    return;
+  }
+#endif
+  std::memcpy(target, source, bytes);
+}
+
+std::unique_ptr<OrtValue> KV_Buffers::CreatePresent(size_t index, const OrtValue* past, std::span<const int64_t> shape, ONNXTensorElementDataType type) {
+  // DML allocations aren't plain pointers, so tensors can't be put on them
+  if (model_.device_type_ != DeviceType::CPU && model_.device_type_ != DeviceType::CUDA)
+    return OrtValue::CreateTensor(*model_.allocator_device_, shape, type);
+
+  auto& pair = buffers_[index];
+  const bool past_in_first = past && pair[0].data && past->GetTensorRawData() == pair[0].data.get();
+  auto& buffer = past_in_first ? pair[1] : pair[0];
+
+  size_t bytes = SizeOf(type);
+  for (auto dim : shape)
+    bytes *= dim;
+  return OrtValue::CreateTensor(model_.allocator_device_->GetInfo(), Reserve(buffer, bytes), bytes, shape, type);
+}
+
+void KV_Buffers::ReorderBeams(OrtValue& tensor, std::span<const int32_t> beam_indices, size_t group_count) {
+  const size_t beam_count = beam_indices.size();
+  auto type_info = tensor.GetTensorTypeAndShapeInfo();
+  const size_t group_bytes = type_info->GetElementCount() * SizeOf(type_info->GetElementType()) / group_count;
+  const size_t block_bytes = group_bytes / beam_count;
+
+  // A beam has to be saved if another beam continues it, but it continues a different beam itself
+  saved_slots_.assign(beam_count, -1);
+  size_t saved_count = 0;
+  for (size_t j = 0; j < beam_count; j++) {
+    const int32_t source = beam_indices[j];
+    if (source != static_cast<int32_t>(j) && beam_indices[source] != source && saved_slots_[source] < 0)
+      saved_slots_[source] = static_cast<int32_t>(saved_count++);
+  }
+
+  auto* data = static_cast<uint8_t*>(tensor.GetTensorMutableRawData());
+  auto* scratch = saved_count ? Reserve(scratch_, group_count * saved_count * block_bytes) : nullptr;
+  for (size_t group = 0; group < group_count; group++) {
+    auto* group_data = data + group * group_bytes;
+    auto* group_scratch = scratch + group * saved_count * block_bytes;
+
+    for (size_t j = 0; j < beam_count; j++) {
+      if (saved_slots_[j] >= 0)
+        CopyBytes(group_scratch + saved_slots_[j] * block_bytes, group_data + j * block_bytes, block_bytes);
+    }
+
+    for (size_t j = 0; j < beam_count; j++) {
+      const int32_t source = beam_indices[j];
+      if (source == static_cast<int32_t>(j))
+        continue;
+      const uint8_t* from = saved_slots_[source] >= 0 ? group_scratch + saved_slots_[source] * block_bytes : group_data + source * block_bytes;
+      CopyBytes(group_data + j * block_bytes, from, block_bytes);
+    }
+  }
+}
+
 KV_Cache_Combined::KV_Cache_Combined(const Model& model, State& state)
     : model_{model},
       state_{state},
@@ -25,6 +124,7 @@ KV_Cache_Combined::KV_Cache_Combined(const Model& model, State& state)
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
 
   empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+  buffers_.emplace(model_, layer_count_, SizeOf(type_) * 2 * shape_[1] * shape_[2] * state_.params_->search.max_length * shape_[4]);
   shape_[3] = state_.params_->sequence_length;
 
   for (int i = 0; i < layer_count_; ++i) {
@@ -48,68 +148,40 @@ void KV_Cache_Combined::Update(std::span<const int32_t> beam_indices, int curren
   assert(state_.params_->search.num_beams == 1 || !beam_indices.empty());  // We require beam_indices if we're a beam search
 
   for (int i = 0; i < layer_count_; i++) {
-    if (beam_indices.empty()) {
-      pasts_[i] = std::move(presents_[i]);
-    } else {
-      PickPastState(beam_indices, i);
-    }
+    if (!beam_indices.empty())
+      buffers_->ReorderBeams(*presents_[i], beam_indices, 2);  // The keys and the values
+    pasts_[i] = std::move(presents_[i]);
   }
 
   shape_[3] = current_length;
   for (int i = 0; i < layer_count_; i++) {
-    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    presents_[i] = buffers_->CreatePresent(i, pasts_[i].get(), shape_, type_);
     state_.inputs_[input_index_ + i] = pasts_[i].get();
     state_.outputs_[output_index_ + i] = presents_[i].get();
   }
 }
 
-// Copy present state to past state reordered by the beam_indices
-template <typename ScoreType>
-void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  auto block_size_per_beam = shape_[2] * shape_[3] * shape_[4];
-  auto past_key_size = shape_[1] * block_size_per_beam;
-  auto element_count = shape_[0] * past_key_size;
-
-  const OrtValue& present = *presents_[index];
-  std::unique_ptr<OrtValue> past = OrtValue::CreateTensor<ScoreType>(*model_.allocator_device_, shape_);
-  auto past_span = std::span<ScoreType>(past->GetTensorMutableData<ScoreType>(), element_count);
-  auto present_span = std::span<const ScoreType>(present.GetTensorData<ScoreType>(), element_count);
+void KV_Cache_Combined::SetPrefix(std::vector<std::unique_ptr<OrtValue>> pasts) {
+  assert(pasts.size() == pasts_.size());
+  pasts_ = std::move(pasts);
+  for (int i = 0; i < layer_count_; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+}
 
-#if USE_CUDA
-  if (model_.device_type_ == DeviceType::CUDA) {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t beam_index = beam_indices[j];
-      auto present_key = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto present_value = present_span.subspan(past_key_size + beam_index * block_size_per_beam, block_size_per_beam);
-
-      auto past_key = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      auto past_value = past_span.subspan(past_key_size + j * block_size_per_beam, block_size_per_beam);
-      cudaMemcpyAsync(past_key.data(), present_key.data(), present_key.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-      cudaMemcpyAsync(past_value.data(), present_value.data(), present_value.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-    }
-  } else
-#endif
-  {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t const beam_index = beam_indices[j];
-      auto present_key = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto present_value = present_span.subspan(past_key_size + beam_index * block_size_per_beam, block_size_per_beam);
-
-      auto past_key = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      auto past_value = past_span.subspan(past_key_size + j * block_size_per_beam, block_size_per_beam);
-      copy(present_key, past_key);
-      copy(present_value, past_value);
-    }
+void KV_Cache_Combined::SetPresentLength(int length) {
+  shape_[3] = length;
+  for (int i = 0; i < layer_count_; i++) {
+    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
   }
-
-  pasts_[index] = std::move(past);
 }
 
-void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  if (type_ == Ort::TypeToTensorType<float>::type) {
-    PickPastState<float>(beam_indices, index);
-  } else {
-    PickPastState<Ort::Float16_t>(beam_indices, index);
+void KV_Cache_Combined::Rewind(int length) {
+  assert(model_.device_type_ == DeviceType::CPU && length <= shape_[3]);
+  shape_[3] = length;
+  for (int i = 0; i < layer_count_; i++) {
+    presents_[i] = SliceSequence(*presents_[i], length, *model_.allocator_device_);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
   }
 }
 
@@ -143,6 +215,9 @@ KV_Cache::KV_Cache(const Model& model, State& state)
 
   empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
 
+  if (!past_present_share_buffer_)
+    buffers_.emplace(model_, layer_count_ * 2, SizeOf(type_) * shape_[0] * shape_[1] * state_.params_->search.max_length * shape_[3]);
+
   // Set the size after empty_past_ has been created with 0 for this field
   if (past_present_share_buffer_)
     shape_[2] = state_.params_->search.max_length;
@@ -198,59 +273,41 @@ void KV_Cache::Update(std::span<const int32_t> beam_indices, int current_length)
     return;
 
   for (int i = 0; i < layer_count_ * 2; i++) {
-    if (beam_indices.empty()) {
-      pasts_[i] = std::move(presents_[i]);
-    } else {
-      PickPastState(beam_indices, i);
-    }
+    if (!beam_indices.empty())
+      buffers_->ReorderBeams(*presents_[i], beam_indices, 1);
+    pasts_[i] = std::move(presents_[i]);
     state_.inputs_[input_index_ + i] = pasts_[i].get();
   }
 
   shape_[2] = current_length;
   for (int i = 0; i < layer_count_ * 2; i++) {
-    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    presents_[i] = buffers_->CreatePresent(i, pasts_[i].get(), shape_, type_);
     state_.outputs_[output_index_ + i] = presents_[i].get();
   }
 }
 
-// Copy present state to past state reordered by the beam_indices
-template <typename ScoreType>
-void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  auto block_size_per_beam = shape_[1] * shape_[2] * shape_[3];
-  auto element_count = shape_[0] * block_size_per_beam;
-
-  const OrtValue& present_value = *presents_[index];
-  std::unique_ptr<OrtValue> past_value = OrtValue::CreateTensor<ScoreType>(*model_.allocator_device_, shape_);
-  auto past_span = std::span<ScoreType>(past_value->GetTensorMutableData<ScoreType>(), element_count);
-  auto present_span = std::span<const ScoreType>(present_value.GetTensorData<ScoreType>(), element_count);
+void KV_Cache::SetPrefix(std::vector<std::unique_ptr<OrtValue>> pasts) {
+  assert(pasts.size() == pasts_.size() && !past_present_share_buffer_);
+  pasts_ = std::move(pasts);
+  for (int i = 0; i < layer_count_ * 2; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+}
 
-#if USE_CUDA
-  if (model_.device_type_ == DeviceType::CUDA) {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t beam_index = beam_indices[j];
-      auto present = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto past = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      cudaMemcpyAsync(past.data(), present.data(), present.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-    }
-  } else
-#endif
-  {
-    for (size_t j = 0; j < beam_indices.size(); j++) {
-      int32_t const beam_index = beam_indices[j];
-      auto present = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-      auto past = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      copy(present, past);
-    }
+void KV_Cache::SetPresentLength(int length) {
+  assert(!past_present_share_buffer_);
+  shape_[2] = length;
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
   }
-
-  pasts_[index] = std::move(past_value);
 }
 
-void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
-  if (type_ == Ort::TypeToTensorType<float>::type) {
-    PickPastState<float>(beam_indices, index);
-  } else {
-    PickPastState<Ort::Float16_t>(beam_indices, index);
+void KV_Cache::Rewind(int length) {
+  assert(!past_present_share_buffer_ && model_.device_type_ == DeviceType::CPU && length <= shape_[2]);
+  shape_[2] = length;
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    presents_[i] = SliceSequence(*presents_[i], length, *model_.allocator_device_);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
   }
 }
 
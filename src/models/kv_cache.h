@@ -4,15 +4,44 @@
 
 namespace Generators {
 
+// Two buffers per KV tensor that swap roles every step: a step's presents become the next step's pasts where they are,
+// and the next presents go in the other buffer. The buffers only grow (doubling, up to the size at max_length) so
+// after a few steps nothing gets allocated. Beam search reorders the presents in place before they become the pasts.
+struct KV_Buffers {
+  KV_Buffers(const Model& model, size_t tensor_count, size_t max_bytes);
+
+  // A present tensor on whichever of tensor index's buffers doesn't hold past
+  std::unique_ptr<OrtValue> CreatePresent(size_t index, const OrtValue* past, std::span<const int64_t> shape, ONNXTensorElementDataType type);
+
+  // Reorders the beams of each of the group_count groups in tensor so beam j holds what beam beam_indices[j] held.
+  // Beams continuing themselves aren't copied, and ones read after being overwritten are saved to a scratch buffer first.
+  void ReorderBeams(OrtValue& tensor, std::span<const int32_t> beam_indices, size_t group_count);
+
+ private:
+  struct Buffer {
+    Ort::IAllocatorUniquePtr<uint8_t> data;
+    size_t bytes{};
+  };
+
+  uint8_t* Reserve(Buffer& buffer, size_t bytes);
+  void CopyBytes(uint8_t* target, const uint8_t* source, size_t bytes);
+
+  const Model& model_;
+  size_t max_bytes_;
+  std::vector<std::array<Buffer, 2>> buffers_;
+  Buffer scratch_;
+  std::vector<int32_t> saved_slots_;  // For each beam, where in scratch_ it was saved, or -1
+};
+
 struct KV_Cache_Combined {
   KV_Cache_Combined(const Model& model, State& state);
 
   void Add();  // Add to state inputs/outputs
   void Update(std::span<const int32_t> beam_indices, int current_length);
-
-  template <typename ScoreType>
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
+  void SetPrefix(std::vector<std::unique_ptr<OrtValue>> pasts);  // Use pasts (from the prefix cache) as the first run's past
+  void SetPresentLength(int length);                              // Reallocate the first run's presents to length tokens, for a chunked prefill
+  void Rewind(int length);                                        // Keep only the first length tokens of the presents, dropping rejected speculative tokens
+  std::span<const std::unique_ptr<OrtValue>> GetPresents() const { return presents_; }
 
  private:
   const Model& model_;
@@ -26,6 +55,7 @@ struct KV_Cache_Combined {
   std::unique_ptr<OrtValue> empty_past_;
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
+  std::optional<KV_Buffers> buffers_;
 };
 
 struct KV_Cache {
@@ -34,9 +64,10 @@ struct KV_Cache {
   void AddEncoder();  // If model has an initial encoder step, this is used
   void Add();
   void Update(std::span<const int32_t> beam_indices, int current_length);
-  template <typename ScoreType>
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
-  void PickPastState(std::span<const int32_t> beam_indices, int index);
+  void SetPrefix(std::vector<std::unique_ptr<OrtValue>> pasts);  // Use pasts (from the prefix cache) as the first run's past
+  void SetPresentLength(int length);                              // Reallocate the first run's presents to length tokens, for a chunked prefill
+  void Rewind(int length);                                        // Keep only the first length tokens of the presents, dropping rejected speculative tokens
+  std::span<const std::unique_ptr<OrtValue>> GetPresents() const { return presents_; }
 
  private:
   const Model& model_;
@@ -52,8 +83,12 @@ struct KV_Cache {
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
   std::vector<StaticBuffer*> sb_kv_caches_;
+  std::optional<KV_Buffers> buffers_;
 };
 
+// Copies the first 'length' tokens along the sequence axis (the second to last one) of a KV tensor on the CPU
+std::unique_ptr<OrtValue> SliceSequence(const OrtValue& source, int64_t length, OrtAllocator& allocator);
+
 // Very similar to the KV_Cache, but is only created once at the encoder step, then used without modification for every decoder step
 struct Cross_Cache {
   Cross_Cache(const Model& model, State& state);
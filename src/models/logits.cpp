@@ -9,16 +9,18 @@
 
 namespace Generators {
 
-Logits::Logits(const Model& model, State& state)
+Logits::Logits(const Model& model, State& state, bool defer_prompt_logits)
     : model_{model},
       state_{state},
       shape_{static_cast<int64_t>(state_.params_->batch_size) * state_.params_->search.num_beams, state_.params_->sequence_length, state_.params_->vocab_size},
       type_{model_.session_info_->GetOutputDataType(model_.config_->model.decoder.outputs.logits)} {
-  auto logits_tensor = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
-  if (type_ == Ort::TypeToTensorType<float>::type)
-    value32_ = std::move(logits_tensor);
-  else
-    value16_ = std::move(logits_tensor);
+  if (!defer_prompt_logits) {
+    auto logits_tensor = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    if (type_ == Ort::TypeToTensorType<float>::type)
+      value32_ = std::move(logits_tensor);
+    else
+      value16_ = std::move(logits_tensor);
+  }
 
   if (state_.GetCapturedGraphInfo()) {
     if (type_ == Ort::TypeToTensorType<float>::type) {
@@ -38,11 +40,44 @@ Logits::Logits(const Model& model, State& state)
 #endif
 }
 
+void Logits::SkipPrefix(int length) {
+  assert(state_.params_->sequence_length > length && !sb_logits32_ && !sb_logits16_);
+  prefix_length_ = length;
+  shape_[1] = state_.params_->sequence_length - length;
+
+  auto logits_tensor = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+  if (type_ == Ort::TypeToTensorType<float>::type)
+    value32_ = std::move(logits_tensor);
+  else
+    value16_ = std::move(logits_tensor);
+  state_.outputs_[output_index_] = type_ == Ort::TypeToTensorType<float>::type ? value32_.get() : value16_.get();
+}
+
+void Logits::Append(int token_count) {
+  assert(shape_[0] == 1 && !sb_logits32_ && !sb_logits16_);
+  appended_ = true;
+  shape_[1] = token_count;
+
+  auto logits_tensor = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+  if (type_ == Ort::TypeToTensorType<float>::type)
+    value32_ = std::move(logits_tensor);
+  else
+    value16_ = std::move(logits_tensor);
+  state_.outputs_[output_index_] = type_ == Ort::TypeToTensorType<float>::type ? value32_.get() : value16_.get();
+}
+
 RoamingArray<float> Logits::Get() {
   size_t element_count = shape_[0] * shape_[1] * shape_[2];
 
-  // Convert from float16 to float32 if necessary
-  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+  // On the prompt's run only the last token of each row is kept, so on the CPU and CUDA those rows are converted from
+  // float16 (or bfloat16 on the CPU) while being gathered below instead of converting every token's logits first
+  const bool is_fp16 = type_ == Ort::TypeToTensorType<Ort::Float16_t>::type;
+  const bool is_bf16 = type_ == Ort::TypeToTensorType<Ort::BFloat16_t>::type;
+  const bool gather_16bit = shape_[1] != 1 && ((is_fp16 && model_.device_type_ != DeviceType::DML) ||
+                                               (is_bf16 && model_.device_type_ == DeviceType::CPU));
+
+  // Convert from float16/bfloat16 to float32 if necessary
+  if ((is_fp16 || is_bf16) && !gather_16bit) {
 #if USE_DML
     if (model_.device_type_ == DeviceType::DML) {
       DmlHelpers::DmlCastInputToOutput(
@@ -81,12 +116,12 @@ RoamingArray<float> Logits::Get() {
 
     size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
 
-    const auto* input_ids = state_.params_->input_ids.data();
+    const auto* input_ids = state_.params_->input_ids.data() + prefix_length_;
     for (int batch_index = 0; batch_index < state_.params_->batch_size; batch_index++) {
       // Find the first non pad token from the end
       size_t token_index = seq_length;
       while (token_index-- > 0) {
-        if (input_ids[token_index] != state_.params_->pad_token_id)
+        if (appended_ || input_ids[token_index] != state_.params_->pad_token_id)
           break;
       }
 
@@ -117,10 +152,26 @@ RoamingArray<float> Logits::Get() {
 
           case DeviceType::CPU:
           case DeviceType::CUDA: {
-            auto logits = std::span<float>{value32_->GetTensorMutableData<float>(), element_count};
-            auto logits_next = gpu_span<float>{value_next->GetTensorMutableData<float>(), element_count};
+            auto logits_next = gpu_span<float>{value_next->GetTensorMutableData<float>(), shape_[0] * vocab_size};
             auto target = logits_next.subspan(vocab_index, vocab_size);
-            std::span<const float> source = logits.subspan(vocab_index * seq_length + token_index * vocab_size, vocab_size);
+            const size_t source_offset = vocab_index * seq_length + token_index * vocab_size;
+            if (gather_16bit) {
+              std::span<const uint16_t> source{value16_->GetTensorData<uint16_t>() + source_offset, vocab_size};
+              if (model_.device_type_ == DeviceType::CUDA)
+#if USE_CUDA
+                cuda::LaunchFp16ToFp32(source.data(), target.data(), static_cast<int>(vocab_size), model_.cuda_stream_);
+#else
+                throw std::runtime_error("Unexpected CUDA device usage");
+#endif
+              else if (is_bf16)
+                BFloat16ToFloat32(source, std::span<float>{target.data(), target.size()});
+              else
+                FastFloat16ToFloat32(source, std::span<float>{target.data(), target.size()});
+              break;
+            }
+
+            auto logits = std::span<float>{value32_->GetTensorMutableData<float>(), element_count};
+            std::span<const float> source = logits.subspan(source_offset, vocab_size);
             if (model_.device_type_ == DeviceType::CUDA)
 #if USE_CUDA
               CudaCheck() == cudaMemcpyAsync(target.data(), source.data(), source.size_bytes(), cudaMemcpyDeviceToDevice, state_.params_->cuda_stream);
@@ -135,11 +186,12 @@ RoamingArray<float> Logits::Get() {
         vocab_index += vocab_size;
       }
 
-      input_ids += seq_length;
+      input_ids += state_.params_->sequence_length;
     }
 
-    value32_ = std::move(value_next);
-    if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type)
+    appended_ = false;
+    value32_ = std::move(value_next);  // Reused as the conversion target by every later step
+    if (is_fp16 || is_bf16)
       value16_ = !sb_logits16_ ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
                                : sb_logits16_->CreateTensorOnStaticBuffer(shape_, type_);
     state_.outputs_[output_index_] = type_ == Ort::TypeToTensorType<float>::type ? value32_.get() : value16_.get();
@@ -179,6 +231,19 @@ RoamingArray<float> Logits::Get() {
   return batched_logits_cpu;
 }
 
+RoamingArray<float> Logits::GetAll() {
+  if (!appended_ || model_.device_type_ != DeviceType::CPU)
+    throw std::runtime_error("Logits of every token are only available on the CPU after appending tokens");
+  appended_ = false;
+
+  if (type_ != Ort::TypeToTensorType<float>::type)
+    ConvertFp16ToFp32(*model_.allocator_device_, *value16_, value32_, model_.device_type_, model_.cuda_stream_);
+
+  auto logits = cpu_span<float>{value32_->GetTensorMutableData<float>(), static_cast<size_t>(shape_[1] * shape_[2])};
+  HandleEOSArray(logits);
+  return logits;
+}
+
 void Logits::HandleEOSArray(cpu_span<float> batched_logits) {
   if (model_.config_->model.eos_token_ids.empty())
     return;
@@ -186,7 +251,7 @@ void Logits::HandleEOSArray(cpu_span<float> batched_logits) {
   const size_t vocab_size = shape_[2];
   size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
 
-  for (int index = 0; index < shape_[0]; index++) {
+  for (size_t index = 0; index < batched_logits.size() / vocab_size; index++) {
     auto logits = batched_logits.subspan(vocab_index, vocab_size);
     float max = std::numeric_limits<float>::lowest();
     for (auto id : model_.config_->model.eos_token_ids) {
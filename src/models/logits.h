@@ -7,10 +7,16 @@
 namespace Generators {
 
 struct Logits {
-  Logits(const Model& model, State& state);
+  // If defer_prompt_logits is set, the first run's logits are only allocated by SkipPrefix(), so a chunked prefill
+  // never holds logits for the whole prompt
+  Logits(const Model& model, State& state, bool defer_prompt_logits = false);
 
   void Add();
   RoamingArray<float> Get();
+  RoamingArray<float> GetAll();  // After an Append() run, the logits of every appended token [token_count, vocab_size], CPU only
+  void SkipPrefix(int length);  // The first run only produces logits for the tokens after the first length tokens
+  void Append(int token_count);  // The next run is token_count tokens of a single sequence, only the last one's logits are used
+  size_t GetOutputIndex() const { return output_index_; }
 
  private:
   void HandleEOSArray(cpu_span<float> logits);
@@ -18,6 +24,8 @@ struct Logits {
   const Model& model_;
   State& state_;
   size_t output_index_{~0U};
+  int prefix_length_{};  // Input tokens of the first run skipped by SkipPrefix()
+  bool appended_{};      // Set by Append(), the run's tokens aren't from the prompt and are never padding
 
   std::array<int64_t, 3> shape_{};
   ONNXTensorElementDataType type_;
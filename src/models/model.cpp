@@ -36,7 +36,9 @@ static std::wstring CurrentModulePath() {
 
 namespace Generators {
 
-State::State(const GeneratorParams& params) : params_{params.shared_from_this()} {
+State::State(const GeneratorParams& params)
+    : params_{params.shared_from_this()},
+      run_options_{OrtRunOptions::Create()} {
   // Add extra user inputs
   for (auto& input : params.extra_inputs) {
     input_names_.push_back(input.name.c_str());
@@ -75,6 +77,46 @@ OrtValue* State::GetOutput(const char* name) {
   return nullptr;
 }
 
+void State::RunWithoutOutput(OrtSession& session, OrtRunOptions& run_options, size_t output_index) {
+  auto name = output_names_[output_index];
+  auto output = outputs_[output_index];
+  output_names_.erase(output_names_.begin() + output_index);
+  outputs_.erase(outputs_.begin() + output_index);
+
+  Run(session, run_options);
+
+  output_names_.insert(output_names_.begin() + output_index, name);
+  outputs_.insert(outputs_.begin() + output_index, output);
+}
+
+int State::GetPrefillChunkSize(const GeneratorParams& params) {
+  const int chunk_size = params.search.prefill_chunk_size;
+  if (chunk_size <= 0 || chunk_size >= params.sequence_length)
+    return 0;
+
+  // Each chunk extends the past, which shared past/present buffers & graph capture don't allow. Extra inputs span the
+  // whole prompt, and beam search is left out to keep the chunks to a single sequence per batch entry
+  if (params.search.num_beams != 1 || params.search.past_present_share_buffer || params.use_cuda_graph || !params.extra_inputs.empty()) {
+    if (g_log.enabled && g_log.warning)
+      Log("warning", "prefill_chunk_size search option is set, but has been disabled due to the current configuration. See https://aka.ms/generate_config for details");
+    return 0;
+  }
+  return chunk_size;
+}
+
+int State::GetLastPromptToken() const {
+  const auto& params = *params_;
+  int last_token = params.sequence_length - 1;
+  for (int i = 0; i < params.batch_size; i++) {
+    auto input_ids = params.input_ids.subspan(i * params.sequence_length, params.sequence_length);
+    int index = params.sequence_length - 1;
+    while (index > 0 && input_ids[index] == params.pad_token_id)
+      index--;
+    last_token = std::min(last_token, index);
+  }
+  return last_token;
+}
+
 void State::ClearIO() {
   input_names_.clear();
   output_names_.clear();
@@ -229,10 +271,11 @@ ONNXTensorElementDataType SessionInfo::GetOutputDataType(const std::string& name
 }
 
 Model::Model(std::unique_ptr<Config> config) : config_{std::move(config)} {
-  // TODO: add function to create run options
-  run_options_ = OrtRunOptions::Create();
-
   CreateSessionOptions();
+
+  auto& prefix_cache = config_->model.decoder.prefix_cache;
+  if (prefix_cache.max_bytes != 0)
+    prefix_cache_ = std::make_unique<PrefixCache>(prefix_cache.max_bytes, prefix_cache.block_size);
 }
 
 Model::~Model() = default;
@@ -410,7 +453,8 @@ std::shared_ptr<GeneratorParams> CreateGeneratorParams() {
 void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<OrtValue>& p_out, DeviceType device_type, cudaStream_t stream) {
   auto shape_info = in.GetTensorTypeAndShapeInfo();
   auto shape = shape_info->GetShape();
-  assert(shape_info->GetElementType() == Ort::TypeToTensorType<Ort::Float16_t>::type);
+  const bool is_bf16 = shape_info->GetElementType() == Ort::TypeToTensorType<Ort::BFloat16_t>::type;
+  assert(is_bf16 || shape_info->GetElementType() == Ort::TypeToTensorType<Ort::Float16_t>::type);
 
   bool allocate_p_out = p_out == nullptr;
   if (p_out) {
@@ -429,13 +473,19 @@ void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
   switch (device_type) {
     case DeviceType::DML:
       // DML doesn't currently support on-device scoring, so we fall back to the CPU
-    case DeviceType::CPU:
-      for (int i = 0; i < count; i++)
-        fp32[i] = FastFloat16ToFloat32(fp16[i]);
-      break;
+    case DeviceType::CPU: {
+      std::span<const uint16_t> source{fp16, static_cast<size_t>(count)};
+      std::span<float> target{fp32, static_cast<size_t>(count)};
+      if (is_bf16)
+        BFloat16ToFloat32(source, target);
+      else
+        FastFloat16ToFloat32(source, target);
+    } break;
 
 #if USE_CUDA
     case DeviceType::CUDA:
+      if (is_bf16)
+        throw std::runtime_error("ConvertFp16ToFp32 - bfloat16 is only supported on the CPU");
       cuda::LaunchFp16ToFp32(fp16, fp32, count, stream);
       break;
 #endif
@@ -3,6 +3,7 @@
 #pragma once
 #include "ortx_tokenizer.h"
 #include "captured_graph_pool.h"
+#include "prefix_cache.h"
 #include "utils.h"
 
 #if USE_DML
@@ -24,18 +25,35 @@ struct State {
   virtual ~State() = default;
 
   virtual RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices = {}) = 0;
+  // Runs several tokens of a single sequence at once, the ones given to Generator::AppendTokens. current_length includes them
+  virtual RoamingArray<float> RunAppendedTokens(int /*current_length*/, cpu_span<const int32_t> /*tokens*/) { throw std::runtime_error("This model does not support appending tokens"); }
+  // Like RunAppendedTokens, but returns the logits of every token [token_count, vocab_size] so speculated tokens can be checked
+  virtual RoamingArray<float> RunCandidateTokens(int /*current_length*/, cpu_span<const int32_t> /*tokens*/) { throw std::runtime_error("This model does not support speculative decoding"); }
+  // Drops the KV cache of every token after the first length, the ones of rejected candidate tokens
+  virtual void Rewind(int /*length*/) { throw std::runtime_error("This model does not support speculative decoding"); }
   virtual const CapturedGraphInfo* GetCapturedGraphInfo() const { return nullptr; }
 
   OrtValue* GetOutput(const char* name);
 
   std::shared_ptr<const GeneratorParams> params_;
+  std::unique_ptr<OrtRunOptions> run_options_;  // Per state, as run options like gpu_graph_id differ between generators
 
   std::vector<const char*> input_names_, output_names_;
   std::vector<OrtValue*> inputs_, outputs_;
 
  protected:
   void Run(OrtSession& session, OrtRunOptions& run_options);  // Uses the inputs below to run
+  void RunWithoutOutput(OrtSession& session, OrtRunOptions& run_options, size_t output_index);  // Run, but don't request outputs_[output_index]
   void ClearIO();                                             // Clear all inputs/outputs
+
+  static int GetPrefillChunkSize(const GeneratorParams& params);  // The search.prefill_chunk_size that applies, 0 if the prompt is run at once
+
+  // The prompt handling shared by the decoder states, which differ in their KV cache types
+  template <typename KVCache>
+  int SkipCachedPrefix(const Model& model, KVCache& kv_cache);
+  template <typename InputIds, typename Positions, typename KVCache>
+  int RunPrefillChunks(OrtSession& session, int start, int chunk_size, InputIds& input_ids, Positions& position_inputs, KVCache& kv_cache, size_t logits_index);
+  int GetLastPromptToken() const;  // The last position holding a non pad token in every sequence of the prompt
 };
 
 template <typename T>
@@ -97,6 +115,8 @@ struct SessionInfo {
   std::unordered_map<std::string, ONNXTensorElementDataType> inputs_, outputs_;
 };
 
+// A model is read only once created (the prefix cache & captured graph pool synchronize internally), so it can be shared
+// by generators running on different threads. Anything a single generator changes lives in its State.
 struct Model : std::enable_shared_from_this<Model> {
   Model(std::unique_ptr<Config> config);
   virtual ~Model();
@@ -111,7 +131,6 @@ struct Model : std::enable_shared_from_this<Model> {
 
   std::unique_ptr<Config> config_;
   std::unique_ptr<OrtSessionOptions> session_options_;
-  std::unique_ptr<OrtRunOptions> run_options_;
 
   cuda_stream_holder cuda_stream_;
   DeviceType device_type_{DeviceType::CPU};
@@ -119,6 +138,7 @@ struct Model : std::enable_shared_from_this<Model> {
   Ort::Allocator* allocator_device_{};  // Can be CUDA or CPU based on the DeviceType in the model
 
   std::unique_ptr<SessionInfo> session_info_;
+  std::unique_ptr<PrefixCache> prefix_cache_;  // Only set when enabled through model.decoder.prefix_cache
 
   std::shared_ptr<Model> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
 
@@ -150,4 +170,36 @@ struct Model : std::enable_shared_from_this<Model> {
   std::shared_ptr<CapturedGraphPool> captured_graph_pool_;
 };
 
+// Start from the KV of the longest cached prefix of the prompt, returning its length so only the rest of the prompt is run
+template <typename KVCache>
+int State::SkipCachedPrefix(const Model& model, KVCache& kv_cache) {
+  std::vector<std::unique_ptr<OrtValue>> pasts;
+  int prefix_length = model.prefix_cache_->Lookup(params_->input_ids, pasts, model.allocator_cpu_);
+  if (prefix_length != 0)
+    kv_cache.SetPrefix(std::move(pasts));
+  return prefix_length;
+}
+
+// Run the prompt from start in chunks of chunk_size tokens without producing logits, returning where the final chunk
+// starts. The final chunk is left to the caller and must hold the last non pad token of every sequence, as that's the
+// token whose logits are used.
+template <typename InputIds, typename Positions, typename KVCache>
+int State::RunPrefillChunks(OrtSession& session, int start, int chunk_size, InputIds& input_ids, Positions& position_inputs, KVCache& kv_cache, size_t logits_index) {
+  const int last_token = GetLastPromptToken();
+  int chunk_count = 0;
+  for (int end = start + chunk_size; end <= last_token; start = end, end += chunk_size) {
+    input_ids.SetPromptRange(start, end);
+    position_inputs.SetPromptRange(start, end);
+    if (chunk_count++ == 0)
+      kv_cache.SetPresentLength(end);
+    else
+      kv_cache.Update({}, end);
+    RunWithoutOutput(session, *run_options_, logits_index);
+  }
+
+  if (chunk_count != 0)
+    kv_cache.Update({}, params_->sequence_length);
+  return start;
+}
+
 }  // namespace Generators
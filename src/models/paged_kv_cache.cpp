@@ -0,0 +1,100 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "model.h"
+#include "paged_kv_cache.h"
+
+namespace Generators {
+
+PagedKV_Cache::PagedKV_Cache(const Model& model, size_t tensor_count, std::span<const int64_t> kv_shape, size_t batch_axis,
+                             ONNXTensorElementDataType type, int block_count, int block_size)
+    : block_size_{block_size},
+      outer_count_{batch_axis == 1 ? kv_shape[0] : 1},
+      head_count_{kv_shape[batch_axis + 1]},
+      batch_axis_{batch_axis},
+      token_bytes_{static_cast<size_t>(kv_shape.back()) * SizeOf(type)},
+      type_{type} {
+  if (model.device_type_ != DeviceType::CPU)
+    throw std::runtime_error("The paged KV cache currently only supports the CPU device");
+  if (block_count < 1 || block_size < 1)
+    throw std::runtime_error("The paged KV cache needs a block_count and block_size of 1 or greater");
+
+  const size_t block_bytes = outer_count_ * head_count_ * block_size_ * token_bytes_;
+  for (size_t i = 0; i < tensor_count; i++)
+    storage_.push_back(std::make_unique<uint8_t[]>(block_bytes * block_count));
+
+  // Hand out low block numbers first
+  free_blocks_.resize(block_count);
+  std::iota(free_blocks_.rbegin(), free_blocks_.rend(), 0);
+}
+
+uint8_t* PagedKV_Cache::GetBlockRow(size_t tensor_index, int block, int64_t outer, int64_t head) const {
+  auto row = ((block * outer_count_ + outer) * head_count_ + head) * block_size_;
+  return storage_[tensor_index].get() + row * token_bytes_;
+}
+
+void PagedKV_Cache::Reserve(KV_BlockTable& table, int length) {
+  while (static_cast<int>(table.blocks.size()) * block_size_ < length) {
+    if (free_blocks_.empty())
+      throw std::runtime_error("The paged KV cache is out of blocks");
+    table.blocks.push_back(free_blocks_.back());
+    free_blocks_.pop_back();
+  }
+}
+
+void PagedKV_Cache::Release(KV_BlockTable& table) {
+  free_blocks_.insert(free_blocks_.end(), table.blocks.rbegin(), table.blocks.rend());
+  table.blocks.clear();
+  table.length = 0;
+}
+
+void PagedKV_Cache::Write(const KV_BlockTable& table, size_t tensor_index, const OrtValue& present, int64_t batch_index, int64_t present_offset, int count) {
+  assert(static_cast<int>(table.blocks.size()) * block_size_ >= table.length + count);  // Reserve() must be called first
+  assert(present.GetTensorTypeAndShapeInfo()->GetElementType() == type_);
+
+  auto shape = present.GetTensorTypeAndShapeInfo()->GetShape();
+  const int64_t batch_size = shape[batch_axis_];
+  const int64_t present_length = shape[batch_axis_ + 2];
+  auto* present_data = static_cast<const uint8_t*>(present.GetTensorRawData());
+
+  for (int64_t outer = 0; outer < outer_count_; outer++) {
+    for (int64_t head = 0; head < head_count_; head++) {
+      auto present_row = ((outer * batch_size + batch_index) * head_count_ + head) * present_length + present_offset;
+      const uint8_t* source = present_data + present_row * token_bytes_;
+
+      // Copy a run of tokens per block
+      for (int token = table.length; token < table.length + count;) {
+        int offset = token % block_size_;
+        int run = std::min(block_size_ - offset, table.length + count - token);
+        std::memcpy(GetBlockRow(tensor_index, table.blocks[token / block_size_], outer, head) + offset * token_bytes_, source, run * token_bytes_);
+        source += run * token_bytes_;
+        token += run;
+      }
+    }
+  }
+}
+
+void PagedKV_Cache::Gather(const KV_BlockTable& table, size_t tensor_index, OrtValue& past, int64_t batch_index, int64_t past_offset) const {
+  auto shape = past.GetTensorTypeAndShapeInfo()->GetShape();
+  const int64_t batch_size = shape[batch_axis_];
+  const int64_t past_length = shape[batch_axis_ + 2];
+  assert(past_offset + table.length <= past_length);
+  auto* past_data = static_cast<uint8_t*>(past.GetTensorMutableRawData());
+
+  for (int64_t outer = 0; outer < outer_count_; outer++) {
+    for (int64_t head = 0; head < head_count_; head++) {
+      auto past_row = ((outer * batch_size + batch_index) * head_count_ + head) * past_length + past_offset;
+      uint8_t* target = past_data + past_row * token_bytes_;
+      std::memset(target - past_offset * token_bytes_, 0, past_offset * token_bytes_);
+
+      for (int token = 0; token < table.length;) {
+        int run = std::min(block_size_, table.length - token);
+        std::memcpy(target, GetBlockRow(tensor_index, table.blocks[token / block_size_], outer, head), run * token_bytes_);
+        target += run * token_bytes_;
+        token += run;
+      }
+    }
+  }
+}
+
+}  // namespace Generators
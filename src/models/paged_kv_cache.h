@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The blocks holding one sequence's KV, in token order
+struct KV_BlockTable {
+  std::vector<int> blocks;
+  int length{};  // Number of tokens written
+};
+
+// A fixed pool of KV cache blocks, each holding block_size tokens for every past input of the model. Sequences own
+// blocks through a KV_BlockTable, so growing a sequence never moves its existing tokens and freed blocks are reused
+// by any other sequence without fragmentation. Gather() builds the contiguous past tensors the model consumes.
+//
+// KV tensors are [batch, heads, sequence, head_size], with an extra leading dimension of 2 when key & value are
+// combined. Only CPU memory is supported.
+struct PagedKV_Cache {
+  PagedKV_Cache(const Model& model, size_t tensor_count, std::span<const int64_t> kv_shape, size_t batch_axis,
+                ONNXTensorElementDataType type, int block_count, int block_size);
+
+  int GetBlockSize() const { return block_size_; }
+  size_t GetFreeBlockCount() const { return free_blocks_.size(); }
+
+  void Reserve(KV_BlockTable& table, int length);  // Allocates blocks until table can hold length tokens, throws if the pool is exhausted
+  void Release(KV_BlockTable& table);              // Returns every block of table to the pool
+
+  // Copies count tokens of the batch_index entry of 'present', starting at present_offset, into table at table.length.
+  // Does not update table.length, as this is called once per tensor
+  void Write(const KV_BlockTable& table, size_t tensor_index, const OrtValue& present, int64_t batch_index, int64_t present_offset, int count);
+
+  // Copies every token in table into the batch_index entry of 'past', starting at past_offset. The past_offset tokens
+  // before it are zeroed, as they're padding
+  void Gather(const KV_BlockTable& table, size_t tensor_index, OrtValue& past, int64_t batch_index, int64_t past_offset) const;
+
+ private:
+  uint8_t* GetBlockRow(size_t tensor_index, int block, int64_t outer, int64_t head) const;
+
+  int block_size_;
+  int64_t outer_count_;  // 2 when key & value are combined, otherwise 1
+  int64_t head_count_;
+  size_t batch_axis_;
+  size_t token_bytes_;  // head_size * element size
+  ONNXTensorElementDataType type_;
+
+  std::vector<std::unique_ptr<uint8_t[]>> storage_;  // One buffer of [block_count, outer, heads, block_size, head_size] per tensor
+  std::vector<int> free_blocks_;
+};
+
+}  // namespace Generators
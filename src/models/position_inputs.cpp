@@ -84,6 +84,38 @@ void PositionInputs::Update(int current_length) {
   }
 }
 
+void PositionInputs::SetPromptRange(int start, int end) {
+  if (type_ == Ort::TypeToTensorType<int32_t>::type)
+    SetPromptRangeImpl<int32_t>(start, end);
+  else
+    SetPromptRangeImpl<int64_t>(start, end);
+
+  const int64_t batch_beam_size = state_.params_->BatchBeamSize();
+  position_ids_shape_ = {batch_beam_size, end - start};
+  attention_mask_shape_ = {batch_beam_size, end};
+  if (has_posid_input_)
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  if (has_mask_input_)
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+}
+
+void PositionInputs::Append(int current_length, int token_count) {
+  assert(state_.params_->BatchBeamSize() == 1 && !sb_position_ids_ && !sb_attention_mask_);
+  if (type_ == Ort::TypeToTensorType<int32_t>::type)
+    AppendImpl<int32_t>(current_length, token_count);
+  else
+    AppendImpl<int64_t>(current_length, token_count);
+
+  position_ids_shape_ = {1, token_count};
+  attention_mask_shape_ = {1, current_length};
+  // The next Update() continues from position_ids_next_, as after the first run
+  is_first_posid_update_ = true;
+  if (has_posid_input_)
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  if (has_mask_input_)
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+}
+
 void PositionInputs::AddAttentionMask() {
   mask_input_index_ = state_.inputs_.size();
 
@@ -346,6 +378,53 @@ void PositionInputs::InitializeTensors(std::array<int64_t, 2> shape, cpu_span<in
   }
 }
 
+template <typename T>
+void PositionInputs::SetPromptRangeImpl(int start, int end) {
+  // Same values as InitializeTensors, limited to the range
+  const auto& params = *state_.params_;
+  auto position_ids = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{params.batch_size, end - start}, type_);
+  auto attention_mask = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{params.batch_size, end}, type_);
+  auto* position = position_ids->GetTensorMutableData<T>();
+  auto* mask = attention_mask->GetTensorMutableData<T>();
+  for (int i = 0; i < params.batch_size; i++) {
+    const auto* word_id = params.input_ids.data() + i * params.sequence_length;
+    T abs_position = 0;
+    for (int j = 0; j < end; j++, mask++) {
+      bool is_pad = word_id[j] == params.pad_token_id;
+      *mask = is_pad ? 0 : 1;
+      if (j >= start)
+        *position++ = is_pad ? 0 : abs_position;
+      if (!is_pad)
+        abs_position++;
+    }
+  }
+
+  position_ids_ = model_.ExpandInputs(position_ids, params.search.num_beams);
+  attention_mask_ = model_.ExpandInputs(attention_mask, params.search.num_beams);
+}
+
+template <typename T>
+void PositionInputs::AppendImpl(int current_length, int token_count) {
+  // Only pad tokens of the prompt are masked out, and positions continue from the prompt's non pad tokens
+  const auto& params = *state_.params_;
+  const T pad_count = static_cast<T>(params.sequence_length - initial_sequence_lengths_[0]);
+
+  auto position_ids = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{1, token_count}, type_);
+  std::iota(position_ids->GetTensorMutableData<T>(), position_ids->GetTensorMutableData<T>() + token_count, static_cast<T>(current_length - token_count) - pad_count);
+
+  auto position_ids_next = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{1, 1}, type_);
+  *position_ids_next->GetTensorMutableData<T>() = static_cast<T>(current_length) - pad_count;
+
+  auto attention_mask = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{1, current_length}, type_);
+  auto* mask = attention_mask->GetTensorMutableData<T>();
+  for (int i = 0; i < current_length; i++)
+    mask[i] = i < params.sequence_length && params.input_ids[i] == params.pad_token_id ? 0 : 1;
+
+  position_ids_ = model_.ExpandInputs(position_ids, 1);
+  position_ids_next_ = model_.ExpandInputs(position_ids_next, 1);
+  attention_mask_ = model_.ExpandInputs(attention_mask, 1);
+}
+
 template <typename T>
 void PositionInputs::UpdatePositionIDsImpl() {
   // Increment position IDs
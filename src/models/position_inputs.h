@@ -14,6 +14,8 @@ struct PositionInputs {
 
   void Add();
   void Update(int current_length);
+  void SetPromptRange(int start, int end);  // Position ids for prompt tokens [start, end), with the attention mask covering [0, end)
+  void Append(int current_length, int token_count);  // Inputs for token_count tokens of a single sequence ending at current_length
 
  private:
   void AddAttentionMask();
@@ -25,6 +27,10 @@ struct PositionInputs {
   template <typename T>
   void InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths);
 
+  template <typename T>
+  void SetPromptRangeImpl(int start, int end);
+  template <typename T>
+  void AppendImpl(int current_length, int token_count);
   template <typename T>
   void UpdatePositionIDsImpl();
   template <typename T>
@@ -0,0 +1,150 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "model.h"
+#include "kv_cache.h"
+#include "prefix_cache.h"
+
+namespace Generators {
+
+PrefixCache::PrefixCache(size_t max_bytes, int block_size)
+    : max_bytes_{max_bytes},
+      block_size_{block_size} {
+  if (block_size_ < 1)
+    throw std::runtime_error("prefix_cache block_size must be 1 or greater, is " + std::to_string(block_size_));
+}
+
+bool PrefixCache::IsSupported(const Model& model, const GeneratorParams& params) {
+  if (model.device_type_ != DeviceType::CPU || params.batch_size != 1 || params.search.num_beams != 1)
+    return false;
+  // Shared past/present buffers are sized to max_length, and extra inputs can change the KV for the same tokens
+  if (params.search.past_present_share_buffer || params.use_cuda_graph || !params.extra_inputs.empty())
+    return false;
+  return std::find(params.input_ids.begin(), params.input_ids.end(), params.pad_token_id) == params.input_ids.end();
+}
+
+std::vector<uint64_t> PrefixCache::HashBlocks(std::span<const int32_t> tokens, size_t block_count) const {
+  // FNV-1a over the tokens, carried from one block to the next
+  std::vector<uint64_t> hashes(block_count);
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t block = 0; block < block_count; block++) {
+    for (auto token : tokens.subspan(block * block_size_, block_size_)) {
+      hash ^= static_cast<uint32_t>(token);
+      hash *= 1099511628211ull;
+    }
+    hashes[block] = hash;
+  }
+  return hashes;
+}
+
+int PrefixCache::Lookup(std::span<const int32_t> tokens, std::vector<std::unique_ptr<OrtValue>>& pasts, OrtAllocator& allocator) {
+  if (tokens.size() < 2)
+    return 0;
+  auto hashes = HashBlocks(tokens, (tokens.size() - 1) / block_size_);
+
+  std::scoped_lock lock{mutex_};
+  for (size_t block_count = hashes.size(); block_count > 0; block_count--) {
+    auto it = index_.find(hashes[block_count - 1]);
+    if (it == index_.end())
+      continue;
+
+    auto& entry = *it->second;
+    const size_t length = block_count * block_size_;
+    if (!std::equal(tokens.begin(), tokens.begin() + length, entry.tokens.begin()))
+      continue;  // Hash collision
+
+    pasts.clear();
+    for (auto& kv : entry.kv)
+      pasts.push_back(SliceSequence(*kv, length, allocator));
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return static_cast<int>(length);
+  }
+  return 0;
+}
+
+void PrefixCache::Insert(std::span<const int32_t> tokens, std::span<const std::unique_ptr<OrtValue>> presents, OrtAllocator& allocator) {
+  const size_t block_count = tokens.size() / block_size_;
+  if (block_count == 0)
+    return;
+  auto hashes = HashBlocks(tokens, block_count);
+  const size_t length = block_count * block_size_;
+
+  size_t bytes = length * sizeof(int32_t);
+  for (auto& present : presents) {
+    auto type_info = present->GetTensorTypeAndShapeInfo();
+    auto shape = type_info->GetShape();
+    bytes += type_info->GetElementCount() / shape[shape.size() - 2] * length * SizeOf(type_info->GetElementType());
+  }
+  if (bytes > max_bytes_)
+    return;
+
+  std::scoped_lock lock{mutex_};
+
+  // Already cached by an entry at least as long? Then just mark it as used
+  if (auto it = index_.find(hashes.back()); it != index_.end() && std::equal(tokens.begin(), tokens.begin() + length, it->second->tokens.begin())) {
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+
+  while (bytes_ + bytes > max_bytes_)
+    Evict(std::prev(entries_.end()));
+
+  auto& entry = entries_.emplace_front();
+  entry.tokens.assign(tokens.begin(), tokens.begin() + length);
+  entry.hashes = std::move(hashes);
+  for (auto& present : presents)
+    entry.kv.push_back(SliceSequence(*present, length, allocator));
+  entry.bytes = bytes;
+  bytes_ += bytes;
+
+  // Every prefix of the new entry now finds it. An older entry left without a prefix of its own is a prefix of this one,
+  // so it can't be found anymore and only takes up room
+  std::vector<EntryList::iterator> replaced;
+  for (auto hash : entry.hashes) {
+    auto [it, inserted] = index_.try_emplace(hash, entries_.begin());
+    if (inserted)
+      continue;
+    if (std::find(replaced.begin(), replaced.end(), it->second) == replaced.end())
+      replaced.push_back(it->second);
+    it->second = entries_.begin();
+  }
+  for (auto old : replaced) {
+    if (std::none_of(old->hashes.begin(), old->hashes.end(), [&](uint64_t hash) { return index_.at(hash) == old; }))
+      Evict(old);
+  }
+}
+
+void PrefixCache::Evict(EntryList::iterator entry) {
+  // The prefixes it shares with other entries move to the most recently used of them, the rest are dropped
+  for (auto other = entries_.begin(); other != entries_.end(); ++other) {
+    if (other == entry)
+      continue;
+    const size_t shared_count = std::min(entry->hashes.size(), other->hashes.size());
+    for (size_t block = 0; block < shared_count && other->hashes[block] == entry->hashes[block]; block++) {
+      auto it = index_.find(entry->hashes[block]);
+      if (it != index_.end() && it->second == entry)
+        it->second = other;
+    }
+  }
+
+  for (auto hash : entry->hashes) {
+    auto it = index_.find(hash);
+    if (it != index_.end() && it->second == entry)
+      index_.erase(it);
+  }
+  bytes_ -= entry->bytes;
+  entries_.erase(entry);
+}
+
+size_t PrefixCache::GetEntryCount() const {
+  std::scoped_lock lock{mutex_};
+  return entries_.size();
+}
+
+size_t PrefixCache::GetByteCount() const {
+  std::scoped_lock lock{mutex_};
+  return bytes_;
+}
+
+}  // namespace Generators
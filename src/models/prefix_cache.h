@@ -0,0 +1,52 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <list>
+#include <mutex>
+
+namespace Generators {
+
+// Model level cache of the KV computed for prompts, so a prompt sharing a prefix with an earlier one (like a long
+// system prompt) only needs its suffix prefilled. Prompts are hashed in blocks of block_size tokens, each block's hash
+// chaining the previous one, so every block aligned prefix of a cached prompt can be found with one lookup.
+// Entries are evicted least recently used first to stay within max_bytes.
+//
+// KV tensors are [1, heads, sequence, head_size], with an extra leading dimension of 2 when key & value are
+// combined. Only CPU memory is supported. Lookup & Insert can be called concurrently by multiple generators.
+struct PrefixCache {
+  PrefixCache(size_t max_bytes, int block_size);
+
+  static bool IsSupported(const Model& model, const GeneratorParams& params);
+
+  // Finds the longest cached block aligned prefix of tokens, leaving at least one token to be run. On a hit the
+  // prefix's KV is copied into pasts (one per past input) and its length returned, otherwise returns 0.
+  int Lookup(std::span<const int32_t> tokens, std::vector<std::unique_ptr<OrtValue>>& pasts, OrtAllocator& allocator);
+
+  // Caches the KV for the longest block aligned prefix of tokens, presents are the model outputs for all of tokens
+  void Insert(std::span<const int32_t> tokens, std::span<const std::unique_ptr<OrtValue>> presents, OrtAllocator& allocator);
+
+  size_t GetEntryCount() const;
+  size_t GetByteCount() const;
+
+ private:
+  struct Entry {
+    std::vector<int32_t> tokens;  // Block aligned
+    std::vector<uint64_t> hashes;  // Chained hash of each block of tokens
+    std::vector<std::unique_ptr<OrtValue>> kv;
+    size_t bytes{};
+  };
+  using EntryList = std::list<Entry>;
+
+  std::vector<uint64_t> HashBlocks(std::span<const int32_t> tokens, size_t block_count) const;
+  void Evict(EntryList::iterator entry);
+
+  size_t max_bytes_;
+  int block_size_;
+
+  mutable std::mutex mutex_;
+  size_t bytes_{};
+  EntryList entries_;  // Most recently used first
+  std::unordered_map<uint64_t, EntryList::iterator> index_;  // Chained block hash -> most recent entry holding that prefix
+};
+
+}  // namespace Generators
@@ -1,6 +1,7 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include "../generators.h"
+#include "../cpu_features.h"
 
 namespace Generators {
 
@@ -88,4 +89,234 @@ uint16_t FastFloat32ToFloat16(float v) {
   return static_cast<uint16_t>((b & 0x80000000) >> 16 | (e > 112) * ((((e - 112) << 10) & 0x7C00) | m >> 13) | ((e < 113) & (e > 101)) * ((((0x007FF000 + m) >> (125 - e)) + 1) >> 1) | (e > 143) * 0x7FFF);  // sign : normalized : denormalized : saturate
 }
 
+// bfloat16 is the top half of a float32: 1 sign bit, 8 bit exponent, 7 bit fraction
+float BFloat16ToFloat32(uint16_t v) {
+  return bit_cast<float>(static_cast<uint32_t>(v) << 16);
+}
+
+uint16_t Float32ToBFloat16(float v) {
+  const uint32_t b = bit_cast<uint32_t>(v);
+  if ((b & 0x7FFFFFFF) > 0x7F800000)
+    return static_cast<uint16_t>(b >> 16 | 0x0040);  // Keep NaNs NaN (rounding could carry into the exponent)
+  return static_cast<uint16_t>((b + 0x7FFF + ((b >> 16) & 1)) >> 16);  // Round to nearest even
+}
+
+namespace {
+
+// The vectorized kernels convert whole blocks, letting the last block overlap the one before it
+struct ConversionKernels {
+  void (*fp16_to_fp32)(const uint16_t* in, float* out, size_t count);
+  void (*fp32_to_fp16)(const float* in, uint16_t* out, size_t count);
+  void (*bf16_to_fp32)(const uint16_t* in, float* out, size_t count);
+  void (*fp32_to_bf16)(const float* in, uint16_t* out, size_t count);
+};
+
+// Converts fewer values than a block through a zero padded block, so they go through the same instructions
+template <size_t BlockSize, typename TIn, typename TOut>
+void ConvertPadded(void (*convert)(const TIn*, TOut*, size_t), const TIn* in, TOut* out, size_t count) {
+  TIn in_block[BlockSize]{};
+  TOut out_block[BlockSize];
+  std::copy(in, in + count, in_block);
+  convert(in_block, out_block, BlockSize);
+  std::copy(out_block, out_block + count, out);
+}
+
+void Fp16ToFp32Scalar(const uint16_t* in, float* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = FastFloat16ToFloat32(in[i]);
+}
+
+void Fp32ToFp16Scalar(const float* in, uint16_t* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = FastFloat32ToFloat16(in[i]);
+}
+
+void Bf16ToFp32Scalar(const uint16_t* in, float* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = BFloat16ToFloat32(in[i]);
+}
+
+void Fp32ToBf16Scalar(const float* in, uint16_t* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = Float32ToBFloat16(in[i]);
+}
+
+#if CPU_X86
+
+TARGET_F16C void Fp16ToFp32F16c(const uint16_t* in, float* out, size_t count) {
+  if (count < 8)
+    return ConvertPadded<8>(Fp16ToFp32F16c, in, out, count);
+  for (size_t i = 0; i < count; i += 8) {
+    const size_t at = std::min(i, count - 8);
+    _mm256_storeu_ps(out + at, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + at))));
+  }
+}
+
+TARGET_F16C void Fp32ToFp16F16c(const float* in, uint16_t* out, size_t count) {
+  if (count < 8)
+    return ConvertPadded<8>(Fp32ToFp16F16c, in, out, count);
+  for (size_t i = 0; i < count; i += 8) {
+    const size_t at = std::min(i, count - 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + at), _mm256_cvtps_ph(_mm256_loadu_ps(in + at), _MM_FROUND_TO_NEAREST_INT));
+  }
+}
+
+TARGET_AVX2 void Bf16ToFp32Avx2(const uint16_t* in, float* out, size_t count) {
+  if (count < 8)
+    return ConvertPadded<8>(Bf16ToFp32Avx2, in, out, count);
+  for (size_t i = 0; i < count; i += 8) {
+    const size_t at = std::min(i, count - 8);
+    const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + at)));
+    _mm256_storeu_ps(out + at, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+  }
+}
+
+TARGET_AVX2 __m256i RoundToBFloat16Avx2(__m256 v) {
+  const __m256i b = _mm256_castps_si256(v);
+  const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(b, 16), _mm256_set1_epi32(1));
+  const __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(b, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF))), 16);
+  const __m256i nan = _mm256_or_si256(_mm256_srli_epi32(b, 16), _mm256_set1_epi32(0x0040));
+  return _mm256_blendv_epi8(rounded, nan, _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
+}
+
+TARGET_AVX2 void Fp32ToBf16Avx2(const float* in, uint16_t* out, size_t count) {
+  if (count < 16)
+    return ConvertPadded<16>(Fp32ToBf16Avx2, in, out, count);
+  for (size_t i = 0; i < count; i += 16) {
+    const size_t at = std::min(i, count - 16);
+    const __m256i low = RoundToBFloat16Avx2(_mm256_loadu_ps(in + at)), high = RoundToBFloat16Avx2(_mm256_loadu_ps(in + at + 8));
+    // The pack interleaves the 128-bit lanes of its inputs, the permute puts them back in order
+    const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + at), packed);
+  }
+}
+
+TARGET_AVX512 void Fp16ToFp32Avx512(const uint16_t* in, float* out, size_t count) {
+  if (count < 16)
+    return ConvertPadded<16>(Fp16ToFp32Avx512, in, out, count);
+  for (size_t i = 0; i < count; i += 16) {
+    const size_t at = std::min(i, count - 16);
+    _mm512_storeu_ps(out + at, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + at))));
+  }
+}
+
+TARGET_AVX512 void Fp32ToFp16Avx512(const float* in, uint16_t* out, size_t count) {
+  if (count < 16)
+    return ConvertPadded<16>(Fp32ToFp16Avx512, in, out, count);
+  for (size_t i = 0; i < count; i += 16) {
+    const size_t at = std::min(i, count - 16);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + at), _mm512_cvtps_ph(_mm512_loadu_ps(in + at), _MM_FROUND_TO_NEAREST_INT));
+  }
+}
+
+TARGET_AVX512 void Bf16ToFp32Avx512(const uint16_t* in, float* out, size_t count) {
+  if (count < 16)
+    return ConvertPadded<16>(Bf16ToFp32Avx512, in, out, count);
+  for (size_t i = 0; i < count; i += 16) {
+    const size_t at = std::min(i, count - 16);
+    const __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + at)));
+    _mm512_storeu_ps(out + at, _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16)));
+  }
+}
+
+TARGET_AVX512 void Fp32ToBf16Avx512(const float* in, uint16_t* out, size_t count) {
+  if (count < 16)
+    return ConvertPadded<16>(Fp32ToBf16Avx512, in, out, count);
+  for (size_t i = 0; i < count; i += 16) {
+    const size_t at = std::min(i, count - 16);
+    const __m512 v = _mm512_loadu_ps(in + at);
+    const __m512i b = _mm512_castps_si512(v);
+    const __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(b, 16), _mm512_set1_epi32(1));
+    const __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(b, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7FFF))), 16);
+    const __m512i nan = _mm512_or_si512(_mm512_srli_epi32(b, 16), _mm512_set1_epi32(0x0040));
+    const __m512i result = _mm512_mask_mov_epi32(rounded, _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q), nan);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + at), _mm512_cvtepi32_epi16(result));
+  }
+}
+
+#elif CPU_ARM64
+
+void Fp16ToFp32Neon(const uint16_t* in, float* out, size_t count) {
+  if (count < 4)
+    return ConvertPadded<4>(Fp16ToFp32Neon, in, out, count);
+  for (size_t i = 0; i < count; i += 4) {
+    const size_t at = std::min(i, count - 4);
+    vst1q_f32(out + at, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(in + at))));
+  }
+}
+
+void Fp32ToFp16Neon(const float* in, uint16_t* out, size_t count) {
+  if (count < 4)
+    return ConvertPadded<4>(Fp32ToFp16Neon, in, out, count);
+  for (size_t i = 0; i < count; i += 4) {
+    const size_t at = std::min(i, count - 4);
+    vst1_u16(out + at, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(in + at))));
+  }
+}
+
+void Bf16ToFp32Neon(const uint16_t* in, float* out, size_t count) {
+  if (count < 4)
+    return ConvertPadded<4>(Bf16ToFp32Neon, in, out, count);
+  for (size_t i = 0; i < count; i += 4) {
+    const size_t at = std::min(i, count - 4);
+    vst1q_f32(out + at, vreinterpretq_f32_u32(vshll_n_u16(vld1_u16(in + at), 16)));
+  }
+}
+
+void Fp32ToBf16Neon(const float* in, uint16_t* out, size_t count) {
+  if (count < 4)
+    return ConvertPadded<4>(Fp32ToBf16Neon, in, out, count);
+  for (size_t i = 0; i < count; i += 4) {
+    const size_t at = std::min(i, count - 4);
+    const float32x4_t v = vld1q_f32(in + at);
+    const uint32x4_t b = vreinterpretq_u32_f32(v);
+    const uint32x4_t lsb = vandq_u32(vshrq_n_u32(b, 16), vdupq_n_u32(1));
+    const uint32x4_t rounded = vshrq_n_u32(vaddq_u32(b, vaddq_u32(lsb, vdupq_n_u32(0x7FFF))), 16);
+    const uint32x4_t nan = vorrq_u32(vshrq_n_u32(b, 16), vdupq_n_u32(0x0040));
+    const uint32x4_t is_number = vceqq_f32(v, v);
+    vst1_u16(out + at, vmovn_u32(vbslq_u32(is_number, rounded, nan)));
+  }
+}
+
+#endif
+
+const ConversionKernels& GetConversionKernels() {
+  static const ConversionKernels kernels = [] {
+#if CPU_X86
+    if (GetCpuFeatures().avx512)
+      return ConversionKernels{Fp16ToFp32Avx512, Fp32ToFp16Avx512, Bf16ToFp32Avx512, Fp32ToBf16Avx512};
+    if (GetCpuFeatures().avx2)
+      return ConversionKernels{Fp16ToFp32F16c, Fp32ToFp16F16c, Bf16ToFp32Avx2, Fp32ToBf16Avx2};
+    if (GetCpuFeatures().f16c)
+      return ConversionKernels{Fp16ToFp32F16c, Fp32ToFp16F16c, Bf16ToFp32Scalar, Fp32ToBf16Scalar};
+#elif CPU_ARM64
+    return ConversionKernels{Fp16ToFp32Neon, Fp32ToFp16Neon, Bf16ToFp32Neon, Fp32ToBf16Neon};
+#endif
+    return ConversionKernels{Fp16ToFp32Scalar, Fp32ToFp16Scalar, Bf16ToFp32Scalar, Fp32ToBf16Scalar};
+  }();
+  return kernels;
+}
+
+}  // namespace
+
+void FastFloat16ToFloat32(std::span<const uint16_t> fp16, std::span<float> fp32) {
+  assert(fp16.size() == fp32.size());
+  GetConversionKernels().fp16_to_fp32(fp16.data(), fp32.data(), fp16.size());
+}
+
+void FastFloat32ToFloat16(std::span<const float> fp32, std::span<uint16_t> fp16) {
+  assert(fp16.size() == fp32.size());
+  GetConversionKernels().fp32_to_fp16(fp32.data(), fp16.data(), fp32.size());
+}
+
+void BFloat16ToFloat32(std::span<const uint16_t> bf16, std::span<float> fp32) {
+  assert(bf16.size() == fp32.size());
+  GetConversionKernels().bf16_to_fp32(bf16.data(), fp32.data(), bf16.size());
+}
+
+void Float32ToBFloat16(std::span<const float> fp32, std::span<uint16_t> bf16) {
+  assert(bf16.size() == fp32.size());
+  GetConversionKernels().fp32_to_bf16(fp32.data(), bf16.data(), fp32.size());
+}
+
 }  // namespace Generators
\ No newline at end of file
@@ -13,4 +13,15 @@ float Float16ToFloat32(uint16_t v);
 float FastFloat16ToFloat32(const uint16_t x);
 uint16_t FastFloat32ToFloat16(float v);
 
+// bfloat16<->fp32, the conversion to bfloat16 rounds to nearest even
+float BFloat16ToFloat32(uint16_t v);
+uint16_t Float32ToBFloat16(float v);
+
+// Bulk conversions over tensors, vectorized with F16C/AVX2/AVX-512 or NEON when the CPU has them. The vectorized
+// fp16 conversions also handle NaN and Inf.
+void FastFloat16ToFloat32(std::span<const uint16_t> fp16, std::span<float> fp32);
+void FastFloat32ToFloat16(std::span<const float> fp32, std::span<uint16_t> fp16);
+void BFloat16ToFloat32(std::span<const uint16_t> bf16, std::span<float> fp32);
+void Float32ToBFloat16(std::span<const float> fp32, std::span<uint16_t> bf16);
+
 }  // namespace Generators
\ No newline at end of file
@@ -49,7 +49,7 @@ Whisper_State::Whisper_State(const Whisper_Model& model, RoamingArray<int32_t> s
 RoamingArray<float> Whisper_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   switch (run_state_) {
     case RunState::Encoder_Decoder_Init:
-      State::Run(*model_.session_encoder_, *model_.run_options_);
+      State::Run(*model_.session_encoder_, *run_options_);
 
       run_state_ = RunState::Decoder_First;
       return logits_.Get();
@@ -70,7 +70,7 @@ RoamingArray<float> Whisper_State::Run(int current_length, RoamingArray<int32_t>
       break;
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_);
+  State::Run(*model_.session_decoder_, *run_options_);
   return logits_.Get();
 }
 
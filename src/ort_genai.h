@@ -175,6 +175,14 @@ struct OgaGeneratorParams : OgaAbstract {
     OgaCheckResult(OgaGeneratorParamsSetSearchBool(this, name, value));
   }
 
+  void SetRowSearchOption(size_t row, const char* name, double value) {
+    OgaCheckResult(OgaGeneratorParamsSetRowSearchNumber(this, row, name, value));
+  }
+
+  void SetRowSearchOptionBool(size_t row, const char* name, bool value) {
+    OgaCheckResult(OgaGeneratorParamsSetRowSearchBool(this, row, name, value));
+  }
+
   void SetInputIDs(const int32_t* input_ids, size_t input_ids_count, size_t sequence_length, size_t batch_size) {
     OgaCheckResult(OgaGeneratorParamsSetInputIDs(this, input_ids, input_ids_count, sequence_length, batch_size));
   }
@@ -187,6 +195,14 @@ struct OgaGeneratorParams : OgaAbstract {
     OgaCheckResult(OgaGeneratorParamsSetModelInput(this, name, &tensor));
   }
 
+  void SetDraftModel(const OgaModel& draft_model) {
+    OgaCheckResult(OgaGeneratorParamsSetDraftModel(this, &draft_model));
+  }
+
+  void AddLogitsProcessor(OgaLogitsProcessorCallback callback, void* user_data) {
+    OgaCheckResult(OgaGeneratorParamsAddLogitsProcessor(this, callback, user_data));
+  }
+
   void TryGraphCaptureWithMaxBatchSize(int max_batch_size) {
     OgaCheckResult(OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(this, max_batch_size));
   }
@@ -213,6 +229,16 @@ struct OgaGenerator : OgaAbstract {
     OgaCheckResult(OgaGenerator_GenerateNextToken(this));
   }
 
+  void AppendTokens(const int32_t* tokens, size_t token_count) {
+    OgaCheckResult(OgaGenerator_AppendTokens(this, tokens, token_count));
+  }
+
+#if __cplusplus >= 202002L
+  void AppendTokens(std::span<const int32_t> tokens) {
+    AppendTokens(tokens.data(), tokens.size());
+  }
+#endif
+
   size_t GetSequenceCount(size_t index) const {
     return OgaGenerator_GetSequenceCount(this, index);
   }
@@ -230,6 +256,25 @@ struct OgaGenerator : OgaAbstract {
   static void operator delete(void* p) { OgaDestroyGenerator(reinterpret_cast<OgaGenerator*>(p)); }
 };
 
+struct OgaAsyncGenerator : OgaAbstract {
+  static std::unique_ptr<OgaAsyncGenerator> Create(const OgaModel& model, const OgaGeneratorParams& params, OgaTokenCallback on_token,
+                                                   OgaDoneCallback on_done, void* user_data) {
+    OgaAsyncGenerator* p;
+    OgaCheckResult(OgaGenerateAsync(&model, &params, on_token, on_done, user_data, &p));
+    return std::unique_ptr<OgaAsyncGenerator>(p);
+  }
+
+  void Cancel() {
+    OgaAsyncGenerator_Cancel(this);
+  }
+
+  bool IsDone() const {
+    return OgaAsyncGenerator_IsDone(this);
+  }
+
+  static void operator delete(void* p) { OgaDestroyAsyncGenerator(reinterpret_cast<OgaAsyncGenerator*>(p)); }
+};
+
 struct OgaTensor : OgaAbstract {
 #if __cplusplus >= 202002L
   static std::unique_ptr<OgaTensor> Create(void* data, std::span<const int64_t> shape, OgaElementType element_type) {
@@ -10,6 +10,8 @@
 #include "generators.h"
 #include "models/model.h"
 #include "search.h"
+#include "async_generator.h"
+#include "logits_processor.h"
 
 namespace Generators {
 
@@ -18,6 +20,25 @@ struct Result {
   std::string what_;
 };
 
+// Rows without options of their own start from the batch wide ones
+Config::Search& GetRowSearch(GeneratorParams& params, size_t row) {
+  if (params.row_search.size() <= row)
+    params.row_search.resize(row + 1, params.search);
+  return params.row_search[row];
+}
+
+struct CallbackLogitsProcessor : LogitsProcessor {
+  CallbackLogitsProcessor(OgaLogitsProcessorCallback callback, void* user_data) : callback_{callback}, user_data_{user_data} {}
+
+  void Process(int row, std::span<const int32_t> sequence, std::span<float> scores) override {
+    callback_(row, sequence.data(), sequence.size(), scores.data(), scores.size(), user_data_);
+  }
+
+ private:
+  OgaLogitsProcessorCallback callback_;
+  void* user_data_;
+};
+
 }  // namespace Generators
 
 extern "C" {
@@ -103,6 +124,20 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchBool(OgaGeneratorParams* gene
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchNumber(OgaGeneratorParams* generator_params, size_t row, const char* name, double value) {
+  OGA_TRY
+  Generators::SetSearchNumber(Generators::GetRowSearch(*reinterpret_cast<Generators::GeneratorParams*>(generator_params), row), name, value);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchBool(OgaGeneratorParams* generator_params, size_t row, const char* name, bool value) {
+  OGA_TRY
+  Generators::SetSearchBool(Generators::GetRowSearch(*reinterpret_cast<Generators::GeneratorParams*>(generator_params), row), name, value);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(OgaGeneratorParams* generator_params, int32_t max_batch_size) {
   OGA_TRY
   auto* params = reinterpret_cast<Generators::GeneratorParams*>(generator_params);
@@ -149,6 +184,24 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetModelInput(OgaGeneratorParams* oga_
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetDraftModel(OgaGeneratorParams* oga_params, const OgaModel* draft_model) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.draft_model = reinterpret_cast<const Generators::Model*>(draft_model)->shared_from_this();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddLogitsProcessor(OgaGeneratorParams* oga_params, OgaLogitsProcessorCallback callback, void* user_data) {
+  OGA_TRY
+  if (!callback)
+    throw std::runtime_error("The logits processor callback can't be null");
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.logits_processors.push_back(std::make_shared<Generators::CallbackLogitsProcessor>(callback, user_data));
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperInputFeatures(OgaGeneratorParams* oga_params, OgaTensor* tensor) {
   OGA_TRY
   auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
@@ -166,6 +219,46 @@ OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorPar
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGenerateAsync(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaTokenCallback on_token,
+                                         OgaDoneCallback on_done, void* user_data, OgaAsyncGenerator** out) {
+  OGA_TRY
+  Generators::AsyncGenerator::TokenCallback token_callback;
+  if (on_token)
+    token_callback = [on_token, user_data](Generators::cpu_span<const int32_t> tokens) { on_token(tokens.data(), tokens.size(), user_data); };
+
+  Generators::AsyncGenerator::DoneCallback done_callback;
+  if (on_done) {
+    done_callback = [on_done, user_data](const Generators::TokenSequences& sequences, std::exception_ptr error) {
+      std::unique_ptr<Generators::Result> result;
+      if (error) {
+        try {
+          std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+          result = std::make_unique<Generators::Result>(e.what());
+        } catch (...) {
+          result = std::make_unique<Generators::Result>("Unknown error");
+        }
+      }
+      on_done(reinterpret_cast<const OgaSequences*>(&sequences), reinterpret_cast<const OgaResult*>(result.get()), user_data);
+    };
+  }
+
+  auto generator = Generators::GenerateAsync(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params),
+                                             std::move(token_callback), std::move(done_callback));
+  generator->external_owner_ = generator;
+  *out = reinterpret_cast<OgaAsyncGenerator*>(generator.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+void OGA_API_CALL OgaAsyncGenerator_Cancel(OgaAsyncGenerator* generator) {
+  reinterpret_cast<Generators::AsyncGenerator*>(generator)->Cancel();
+}
+
+bool OGA_API_CALL OgaAsyncGenerator_IsDone(const OgaAsyncGenerator* generator) {
+  return reinterpret_cast<const Generators::AsyncGenerator*>(generator)->IsDone();
+}
+
 OgaResult* OgaCreateGenerator(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaGenerator** out) {
   OGA_TRY
   *out = reinterpret_cast<OgaGenerator*>(CreateGenerator(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params)).release());
@@ -191,6 +284,13 @@ OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator)
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_AppendTokens(OgaGenerator* generator, const int32_t* tokens, size_t token_count) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->AppendTokens(Generators::cpu_span<const int32_t>(tokens, token_count));
+  return nullptr;
+  OGA_CATCH
+}
+
 size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator* oga_generator, size_t index) {
   auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
   return generator.GetSequence(static_cast<int>(index)).GetCPU().size();
@@ -335,6 +435,10 @@ void OGA_API_CALL OgaDestroyGenerator(OgaGenerator* p) {
   delete reinterpret_cast<Generators::Generator*>(p);
 }
 
+void OGA_API_CALL OgaDestroyAsyncGenerator(OgaAsyncGenerator* p) {
+  reinterpret_cast<Generators::AsyncGenerator*>(p)->external_owner_ = nullptr;
+}
+
 void OGA_API_CALL OgaDestroyTokenizer(OgaTokenizer* p) {
   reinterpret_cast<Generators::Tokenizer*>(p)->external_owner_ = nullptr;
 }
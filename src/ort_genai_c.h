@@ -28,7 +28,11 @@ extern "C" {
 #endif
 
 // ONNX Runtime Generative AI C API
-// This API is not thread safe.
+//
+// Thread safety: A model (and its tokenizer) can be shared by any number of generators, each running on its own thread,
+// so parallel requests don't need the weights loaded more than once. A single generator, generator params, sequences or
+// tokenizer stream object must only be used by one thread at a time. Log options are global and should be set before
+// generators are running on other threads. On DML, generators of the same model must not run concurrently.
 
 typedef enum OgaElementType {
   OgaElementType_undefined,
@@ -57,6 +61,21 @@ typedef struct OgaSequences OgaSequences;
 typedef struct OgaTokenizer OgaTokenizer;
 typedef struct OgaTokenizerStream OgaTokenizerStream;
 typedef struct OgaTensor OgaTensor;
+typedef struct OgaAsyncGenerator OgaAsyncGenerator;
+
+/* Called by OgaGenerateAsync after every generation step with the new token of each sequence (batch_size * num_beams
+   tokens). The tokens are only valid during the call. */
+typedef void(OGA_API_CALL* OgaTokenCallback)(const int32_t* tokens, size_t token_count, void* user_data);
+
+/* Called once when an OgaGenerateAsync generation ends. On success or cancellation 'result' is null and 'sequences'
+   holds the generated sequences, on failure 'result' holds the error. Both are only valid during the call. */
+typedef void(OGA_API_CALL* OgaDoneCallback)(const OgaSequences* sequences, const OgaResult* result, void* user_data);
+
+/* Called on every step with the logits (vocab_size scores) of one batch_beam row and that row's sequence so far, to
+   modify the logits in place before the next token is picked. Can be called from several threads at once for different
+   rows when the 'num_threads' search option isn't 1. The pointers are only valid during the call. */
+typedef void(OGA_API_CALL* OgaLogitsProcessorCallback)(int32_t row, const int32_t* sequence, size_t sequence_length,
+                                                        float* logits, size_t vocab_size, void* user_data);
 
 /* \brief Call this on process exit to cleanly shutdown the genai library & its onnxruntime usage
  */
@@ -135,6 +154,35 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyModel(OgaModel* model);
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaSequences** out);
 
+/*
+ * \brief Starts generating on an internal worker pool and returns right away. Each generation step is queued separately,
+ *        so many generations share the pool's threads instead of each blocking a caller thread. on_token is called after
+ *        every step and on_done exactly once at the end, both from a worker thread, so user_data must stay valid until
+ *        on_done has been called. OgaShutdown waits for running generations to finish.
+ * \param[in] model The model to use for generation.
+ * \param[in] generator_params The parameters to use for generation.
+ * \param[in] on_token Called with the new tokens after every step, can be null. That's one token per sequence, or with
+ *                     speculative decoding every token the step added to the single sequence.
+ * \param[in] on_done Called when the generation ends, can be null.
+ * \param[in] user_data Passed to on_token and on_done.
+ * \param[out] out The generation handle, to be destroyed with OgaDestroyAsyncGenerator. Destroying it doesn't stop the
+ *             generation, use OgaAsyncGenerator_Cancel for that.
+ * \return OgaResult containing the error message if the generation could not be started.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerateAsync(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaTokenCallback on_token,
+                                                    OgaDoneCallback on_done, void* user_data, OgaAsyncGenerator** out);
+
+/*
+ * \brief Stops the generation after its current step, on_done is still called with the sequences generated so far.
+ */
+OGA_EXPORT void OGA_API_CALL OgaAsyncGenerator_Cancel(OgaAsyncGenerator* generator);
+
+/*
+ * \brief Returns true once the generation has ended and on_done has returned.
+ */
+OGA_EXPORT bool OGA_API_CALL OgaAsyncGenerator_IsDone(const OgaAsyncGenerator* generator);
+OGA_EXPORT void OGA_API_CALL OgaDestroyAsyncGenerator(OgaAsyncGenerator* generator);
+
 /*
  * \brief Creates a OgaGeneratorParams from the given model.
  * \param[in] model The model to use for generation.
@@ -151,6 +199,20 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyGeneratorParams(OgaGeneratorParams* gener
 
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchNumber(OgaGeneratorParams* generator_params, const char* name, double value);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchBool(OgaGeneratorParams* generator_params, const char* name, bool value);
+
+/*
+ * \brief Sets a search option for a single batch row, so rows with different sampling settings can share a batch. A row's
+ *        options start as a copy of the batch wide ones when its first option is set, so set those first. Rows without
+ *        options of their own use the batch wide ones. Only supported by the CPU greedy search (num_beams of 1).
+ * \param[in] generator_params The generator params to set the option on.
+ * \param[in] row The batch row, less than the batch size.
+ * \param[in] name The name of the option, one of do_sample, min_length, max_length (up to the batch wide max_length),
+ *            top_k, top_p, temperature, repetition_penalty or random_seed.
+ * \param[in] value The value of the option.
+ * \return OgaResult containing the error message if the option is unknown.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchNumber(OgaGeneratorParams* generator_params, size_t row, const char* name, double value);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchBool(OgaGeneratorParams* generator_params, size_t row, const char* name, bool value);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(OgaGeneratorParams* generator_params, int32_t max_batch_size);
 
 /*
@@ -184,6 +246,27 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetModelInput(OgaGeneratorP
 
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperInputFeatures(OgaGeneratorParams*, OgaTensor* tensor);
 
+/*
+ * \brief Enables speculative decoding, where the smaller draft model proposes the 'num_speculative_tokens' search option's
+ *        count of tokens per step and the model checks them in a single run. The output follows the same distribution as
+ *        without a draft model. Only supported on the CPU with a batch size of 1 and no beam search.
+ * \param[in] generator_params The generator params to set the draft model on.
+ * \param[in] draft_model The draft model, it must use the same tokenizer as the model. It is kept alive by the params.
+ * \return OgaResult containing the error message if setting the draft model failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetDraftModel(OgaGeneratorParams* generator_params, const OgaModel* draft_model);
+
+/*
+ * \brief Adds a logits processor, run after the built-in min_length, repetition_penalty and no_repeat_ngram_size
+ *        processing. Processors run in the order added, all of them on one row before the next row. Only supported on
+ *        the CPU.
+ * \param[in] generator_params The generator params to add the processor to.
+ * \param[in] callback Called for every row on every step.
+ * \param[in] user_data Passed to the callback, it must stay valid while generators created from the params run.
+ * \return OgaResult containing the error message if adding the processor failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddLogitsProcessor(OgaGeneratorParams* generator_params, OgaLogitsProcessorCallback callback, void* user_data);
+
 /*
  * \brief Creates a generator from the given model and generator params.
  * \param[in] model The model to use for generation.
@@ -214,6 +297,18 @@ OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_ComputeLogits(OgaGenerator* generator);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator);
 
+/*
+ * \brief Appends tokens to the sequence of the generator so generation continues from them, for example the next user
+ *        turn of a chat. The KV cache of the existing sequence is kept, so only the new tokens are run through the model.
+ *        Can be called once generation is done, as long as the sequence stays below max_length. Only supported for a batch
+ *        size of 1 without beam search, and after the first OgaGenerator_ComputeLogits call.
+ * \param[in] generator The generator to append the tokens to.
+ * \param[in] tokens The tokens to append.
+ * \param[in] token_count The number of tokens to append.
+ * \return OgaResult containing the error message if the tokens could not be appended.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_AppendTokens(OgaGenerator* generator, const int32_t* tokens, size_t token_count);
+
 /*
  * \brief Returns the number of tokens in the sequence at the given index.
  * \param[in] generator The generator to get the count of the tokens for the sequence at the given index.
@@ -0,0 +1,54 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace Generators {
+
+// Philox4x32-10 counter-based random engine (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3"). Each
+// 128-bit block is a pure function of the seed, row, step and block index, so a row's draws on a step don't depend on
+// any other row or on what was drawn before. Usable with the std distributions as a UniformRandomBitGenerator.
+struct Philox4x32 {
+  using result_type = uint32_t;
+
+  Philox4x32(uint64_t seed, uint32_t row, uint32_t step)
+      : key_{static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)},
+        counter_{0, step, row, 0} {}
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+  result_type operator()() {
+    if (used_ == block_.size()) {
+      block_ = Generate(counter_, key_);
+      counter_[0]++;  // The block index
+      used_ = 0;
+    }
+    return block_[used_++];
+  }
+
+  static std::array<uint32_t, 4> Generate(std::array<uint32_t, 4> counter, std::array<uint32_t, 2> key) {
+    for (int round = 0; round < 10; round++) {
+      if (round != 0) {
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+      }
+      const uint64_t product0 = uint64_t{0xD2511F53} * counter[0];
+      const uint64_t product1 = uint64_t{0xCD9E8D57} * counter[2];
+      counter = {static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0], static_cast<uint32_t>(product1),
+                 static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1], static_cast<uint32_t>(product0)};
+    }
+    return counter;
+  }
+
+ private:
+  std::array<uint32_t, 2> key_;
+  std::array<uint32_t, 4> counter_;
+  std::array<uint32_t, 4> block_{};
+  size_t used_{block_.size()};
+};
+
+}  // namespace Generators
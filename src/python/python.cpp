@@ -250,15 +250,19 @@ struct PyGeneratorParams {
   }
 
   void SetSearchOptions(const pybind11::kwargs& dict) {
+    ApplySearchOptions(params_->search, dict);
+  }
+
+  static void ApplySearchOptions(Config::Search& search, const pybind11::kwargs& dict) {
     for (auto& entry : dict) {
       auto name = entry.first.cast<std::string>();
       try {
         if (pybind11::isinstance<pybind11::float_>(entry.second)) {
-          SetSearchNumber(params_->search, name, entry.second.cast<double>());
+          SetSearchNumber(search, name, entry.second.cast<double>());
         } else if (pybind11::isinstance<pybind11::bool_>(entry.second)) {
-          SetSearchBool(params_->search, name, entry.second.cast<bool>());
+          SetSearchBool(search, name, entry.second.cast<bool>());
         } else if (pybind11::isinstance<pybind11::int_>(entry.second)) {
-          SetSearchNumber(params_->search, name, entry.second.cast<int>());
+          SetSearchNumber(search, name, entry.second.cast<int>());
         } else
           throw std::runtime_error("Unknown search option type, can be float/bool/int:" + name);
       } catch (JSON::unknown_value_error& e) {
@@ -267,6 +271,16 @@ struct PyGeneratorParams {
     }
   }
 
+  void SetRowSearchOptions(size_t row, const pybind11::kwargs& dict) {
+    if (params_->row_search.size() <= row)
+      params_->row_search.resize(row + 1, params_->search);  // Rows start from the batch wide options
+    ApplySearchOptions(params_->row_search[row], dict);
+  }
+
+  void SetDraftModel(const Model& draft_model) {
+    params_->draft_model = draft_model.shared_from_this();
+  }
+
   void TryUseCudaGraphWithMaxBatchSize(pybind11::int_ max_batch_size) {
     params_->TryGraphCapture(max_batch_size.cast<int>());
   }
@@ -305,6 +319,11 @@ struct PyGenerator {
     generator_->GenerateNextToken();
   }
 
+  void AppendTokens(pybind11::array_t<int32_t> tokens) {
+    auto span = ToSpan(tokens);
+    generator_->AppendTokens(cpu_span<const int32_t>(span.data(), span.size()));
+  }
+
   bool IsDone() const {
     return generator_->IsDone();
   }
@@ -368,6 +387,8 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       .def_readwrite("whisper_input_features", &PyGeneratorParams::py_whisper_input_features_)
       .def("set_model_input", &PyGeneratorParams::SetModelInput)
       .def("set_search_options", &PyGeneratorParams::SetSearchOptions)  // See config.h 'struct Search' for the options
+      .def("set_row_search_options", &PyGeneratorParams::SetRowSearchOptions)
+      .def("set_draft_model", &PyGeneratorParams::SetDraftModel)
       .def("try_use_cuda_graph_with_max_batch_size", &PyGeneratorParams::TryUseCudaGraphWithMaxBatchSize);
 
   pybind11::class_<TokenizerStream>(m, "TokenizerStream")
@@ -403,9 +424,10 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
   pybind11::class_<PyGenerator>(m, "Generator")
       .def(pybind11::init<Model&, PyGeneratorParams&>())
       .def("is_done", &PyGenerator::IsDone)
-      .def("compute_logits", &PyGenerator::ComputeLogits)
+      .def("compute_logits", &PyGenerator::ComputeLogits, pybind11::call_guard<pybind11::gil_scoped_release>())
       .def("get_output", &PyGenerator::GetOutput)
-      .def("generate_next_token", &PyGenerator::GenerateNextToken)
+      .def("generate_next_token", &PyGenerator::GenerateNextToken, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("append_tokens", &PyGenerator::AppendTokens)
       .def("get_next_tokens", &PyGenerator::GetNextTokens)
       .def("get_sequence", &PyGenerator::GetSequence);
 
@@ -2,7 +2,8 @@
 #include "softmax.h"
 #include "search.h"
 #include "beam_search_scorer.h"
-#include <queue>
+#include "worker_pool.h"
+#include "logits_processor.h"
 #include <algorithm>
 
 namespace Generators {
@@ -14,17 +15,28 @@ Search_Cpu::Search_Cpu(const GeneratorParams& params)
   sequence_lengths_buffer_ = AllocateArray<int32_t>(batch_beam_size, &sequence_lengths_);
 }
 
+namespace {
+
+uint64_t ResolveSeed(int random_seed) {
+  if (random_seed != -1)
+    return static_cast<uint32_t>(random_seed);
+  std::random_device rd;
+  return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+
+int32_t TopToken(std::span<const float> scores) {
+  return static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
+}
+
+}  // namespace
+
 GreedySearch_Cpu::GreedySearch_Cpu(const GeneratorParams& params)
     : Search_Cpu(params) {
-  if (params_->search.random_seed != -1)
-    gen_.seed(params_->search.random_seed);
-  else {
-    std::random_device rd;
-    std::array<uint32_t, decltype(gen_)::state_size> data;
-    std::generate(std::begin(data), std::end(data), std::ref(rd));
-    std::seed_seq seq(data.begin(), data.end());
-    gen_.seed(seq);
-  }
+  const uint64_t seed = ResolveSeed(params_->search.random_seed);
+  seeds_.resize(params_->batch_size, seed);
+  for (size_t i = 0; i < params_->row_search.size(); i++)
+    seeds_[i] = ResolveSeed(params_->row_search[i].random_seed);
+  scratch_.resize(params_->batch_size);
 
   next_tokens_buffer_ = AllocateArray<int32_t>(params.batch_size, &next_tokens_);
   memset(next_tokens_.data(), 0, next_tokens_.size_bytes());
@@ -63,54 +75,89 @@ int Search_Cpu::GetSequenceLength() const {
 
 void BeamSearch_Cpu::SelectTop() {
   auto beam_scores = beam_scorer_->GetNextScores();
-  // Add beam score to next token scores. Corresponding python code is like:
-  //    next_token_scores = next_token_scores + beam_scores[:, None].expand_as(next_token_scores)
-  // TODO(tianleiwu): use thread pool to parallel
-  int offset = 0;
-  int batch_beam_index = 0;
-  for (int i = 0; i < params_->batch_size; i++) {
-    for (int j = 0; j < params_->search.num_beams; j++, batch_beam_index++) {
-      for (int k = 0; k < params_->vocab_size; k++, offset++) {
-        next_token_scores_[offset] += beam_scores[batch_beam_index];
-      }
-    }
-  }
+  auto beam_tokens = beam_scorer_->GetNextTokens();
 
   // TODO: Write output scores?
-  const size_t top_k = 2 * params_->search.num_beams;
+  const size_t num_beams = params_->search.num_beams;
+  const size_t num_beam_groups = params_->search.num_beam_groups;
+  const size_t group_size = num_beams / num_beam_groups;
+  const size_t top_k = 2 * group_size;
+  const size_t vocab_size = params_->vocab_size;
+  const float diversity_penalty = params_->search.diversity_penalty;
 
   struct ScoreIndex {
     float score;
     int32_t index;
 
-    bool operator<(const ScoreIndex& s) const { return score < s.score; }
+    // Higher scores first, and the lower index on a tie so the order doesn't depend on the selection
+    bool operator<(const ScoreIndex& s) const { return score > s.score || (score == s.score && index < s.index); }
   };
 
-  auto scores = std::make_unique<float[]>(top_k * params_->batch_size);
-  auto indices = std::make_unique<int32_t[]>(top_k * params_->batch_size);
-  auto tokens = std::make_unique<int32_t[]>(top_k * params_->batch_size);
+  const size_t candidate_count = top_k * params_->batch_size * num_beam_groups;
+  auto scores = std::make_unique<float[]>(candidate_count);
+  auto indices = std::make_unique<int32_t[]>(candidate_count);
+  auto tokens = std::make_unique<int32_t[]>(candidate_count);
+
+  auto next_scores = std::span<float>(scores.get(), candidate_count);
+  auto next_indices = std::span<int32_t>(indices.get(), candidate_count);
+  auto next_tokens = std::span<int32_t>(tokens.get(), candidate_count);
+
+  // With beam groups (diverse beam search, https://arxiv.org/abs/1610.02424) each group picks its beams after the ones
+  // before it, from scores lowered by diversity_penalty for every time those groups picked the token on this step.
+  // All groups share the one batched forward pass, the penalty only needs the tokens the scorer just picked.
+  // Groups done before this step only emit padding, which isn't a pick to penalize
+  std::vector<uint8_t> padded_groups(params_->batch_size * num_beam_groups);
+  for (size_t i = 0; i < padded_groups.size(); i++)
+    padded_groups[i] = beam_scorer_->IsDone(i / num_beam_groups, i % num_beam_groups);
+
+  for (size_t group = 0; group < num_beam_groups; group++) {
+    // One pass over each group's beams that adds the beam score to the token scores (next_token_scores +
+    // beam_scores[:, None] in python) while keeping the top_k so far in a heap, whose worst entry is the bar to get in
+    ParallelFor(params_->batch_size, params_->search.num_threads, [&](size_t batch_index) {
+      const size_t group_index = batch_index * num_beam_groups + group;
+      const size_t group_start = group_index * group_size;
+
+      if (diversity_penalty != 0.0f) {
+        for (size_t previous_group = 0; previous_group < group; previous_group++) {
+          if (padded_groups[batch_index * num_beam_groups + previous_group])
+            continue;
+          for (int32_t previous_token : beam_tokens.subspan(batch_index * num_beams + previous_group * group_size, group_size)) {
+            for (size_t beam_index = 0; beam_index < group_size; beam_index++)
+              next_token_scores_[(group_start + beam_index) * vocab_size + previous_token] -= diversity_penalty;
+          }
+        }
+      }
 
-  auto next_scores = std::span<float>(scores.get(), top_k * params_->batch_size);
-  auto next_indices = std::span<int32_t>(indices.get(), top_k * params_->batch_size);
-  auto next_tokens = std::span<int32_t>(tokens.get(), top_k * params_->batch_size);
+      std::vector<ScoreIndex> top;
+      top.reserve(top_k);
+      for (size_t beam_index = 0; beam_index < group_size; beam_index++) {
+        const size_t batch_beam_index = group_start + beam_index;
+        const float beam_score = beam_scores[batch_beam_index];
+        const float* token_scores = next_token_scores_.data() + batch_beam_index * vocab_size;
+        const int32_t index_base = static_cast<int32_t>(beam_index * vocab_size);
+
+        for (size_t token = 0; token < vocab_size; token++) {
+          ScoreIndex candidate{token_scores[token] + beam_score, index_base + static_cast<int32_t>(token)};
+          if (top.size() < top_k) {
+            top.push_back(candidate);
+            std::push_heap(top.begin(), top.end());
+          } else if (candidate.score > top.front().score) {
+            std::pop_heap(top.begin(), top.end());
+            top.back() = candidate;
+            std::push_heap(top.begin(), top.end());
+          }
+        }
+      }
+      std::sort_heap(top.begin(), top.end());
 
-  for (size_t batch_index = 0; batch_index < static_cast<size_t>(params_->batch_size); batch_index++) {
-    std::priority_queue<ScoreIndex, std::vector<ScoreIndex>> queue;
-    auto token_scores_sub = next_token_scores_.subspan(batch_index * params_->search.num_beams * params_->vocab_size, static_cast<size_t>(params_->search.num_beams) * params_->vocab_size);
-    for (int i = 0; i < token_scores_sub.size(); i++) {
-      queue.push({token_scores_sub[i], i});
-    }
+      for (size_t i = 0; i < top_k; i++) {
+        next_indices[top_k * group_index + i] = top[i].index / params_->vocab_size;
+        next_tokens[top_k * group_index + i] = top[i].index % params_->vocab_size;
+        next_scores[top_k * group_index + i] = top[i].score;
+      }
+    });
 
-    auto next_indices_sub = next_indices.subspan(top_k * batch_index, top_k);
-    auto next_tokens_sub = next_tokens.subspan(top_k * batch_index, top_k);
-    auto next_scores_sub = next_scores.subspan(top_k * batch_index, top_k);
-    for (unsigned i = 0; i < top_k; i++) {
-      auto v = queue.top();
-      next_indices_sub[i] = v.index / params_->vocab_size;
-      next_tokens_sub[i] = v.index % params_->vocab_size;
-      next_scores_sub[i] = v.score;
-      queue.pop();
-    }
+    beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices, group);
   }
 
 #if 0
@@ -119,7 +166,6 @@ void BeamSearch_Cpu::SelectTop() {
   DumpMemory("Next Indices", next_indices);
 #endif
 
-  beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices);
   next_tokens_ = beam_scorer_->GetNextTokens();
 
   AppendNextTokensToSequences();
@@ -127,101 +173,144 @@ void BeamSearch_Cpu::SelectTop() {
 
 void GreedySearch_Cpu::SelectTop() {
   // next_tokens = torch.argmax(scores, dim=-1)
-  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    if (PadIfAlreadyEOS(batch_id)) {
-      continue;
-    }
+  SelectRows([this](size_t batch_id) { return TopToken(GetScores(static_cast<int>(batch_id))); });
+}
 
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    auto const token = static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
-    SetNextToken(batch_id, token);
-  }
+namespace {
 
-  AppendNextTokensToSequences();
-}
+// The sampling of a single row, shared by the batch wide Sample* methods and SelectPerRow
+int32_t SampleTopK(std::span<const float> scores, int k, float temperature, Philox4x32 gen, SamplingScratch& scratch) {
+  // Find the top K on the raw scores, as softmax keeps their order only the K need it
+  auto& indices = scratch.candidates;
+  indices.resize(std::min(static_cast<size_t>(k), scores.size()));
+  top_k_indices(indices, scores);
 
-void SoftMax(std::span<float> scores, float temperature) {
-  float const max_score = *std::max_element(scores.begin(), scores.end());
+  auto& top_scores = scratch.candidate_scores;
+  top_scores.resize(indices.size());
+  std::transform(indices.begin(), indices.end(), top_scores.begin(), [scores = scores.data()](int32_t i) { return scores[i]; });
+  softmax(top_scores, temperature);
 
-  // Subtract max score and scale by temperature
-  std::transform(scores.begin(), scores.end(), scores.begin(), [max_score, temperature](float score) { return std::exp((score - max_score) / temperature); });
+  // Sample a token from the top K
+  std::discrete_distribution<> dis(top_scores.begin(), top_scores.end());
+  return indices[dis(gen)];
+}
 
-  // Compute sum of exponentials
-  float const exp_sum = std::accumulate(scores.begin(), scores.end(), 0.0f);
+// Top-p only needs the most probable tokens, in order, until their sum reaches the sampled threshold. Positive floats
+// order the same as their bits, so bucketing by the exponent and top 3 mantissa bits finds the lowest bucket needed in
+// one pass over the vocabulary, and only the tokens in and above it get sorted.
+constexpr int top_p_bucket_shift = 20;
+constexpr uint32_t top_p_bucket_count = (0x3F800000 >> top_p_bucket_shift) + 1;  // Up to the bits of 1.0f
 
-  // Divide each score by the sum of exponentials
-  std::transform(scores.begin(), scores.end(), scores.begin(), [exp_sum](float score) { return score / exp_sum; });
+uint32_t TopPBucket(float probability) {
+  uint32_t bits;
+  std::memcpy(&bits, &probability, sizeof(bits));
+  return std::min(bits >> top_p_bucket_shift, top_p_bucket_count - 1);
 }
 
-void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
-  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a token from the top K
-    std::discrete_distribution<> dis(scores.begin(), scores.begin() + k);
-    SetNextToken(batch_id, indices[dis(gen_)]);
+int32_t SampleTopP(std::span<float> scores, float p, float temperature, Philox4x32 gen, SamplingScratch& scratch) {
+  std::uniform_real_distribution<float> dis(0, p);
+  softmax(scores, temperature);
+  // Sample a probability threshold
+  float threshold = dis(gen);
+
+  auto& mass = scratch.bucket_mass;
+  mass.assign(top_p_bucket_count, 0.0f);
+  for (float score : scores)
+    mass[TopPBucket(score)] += score;
+
+  uint32_t cutoff = top_p_bucket_count - 1;
+  for (float total = mass[cutoff]; total <= threshold && cutoff > 0;)
+    total += mass[--cutoff];
+
+  auto& candidates = scratch.candidates;
+  candidates.clear();
+  for (int32_t i = 0; i < static_cast<int32_t>(scores.size()); i++) {
+    if (TopPBucket(scores[i]) >= cutoff)
+      candidates.push_back(i);
   }
-  AppendNextTokensToSequences();
+  std::sort(candidates.begin(), candidates.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
+
+  // Find the first token where the cumulative probability exceeds the threshold
+  for (auto token : candidates) {
+    threshold -= scores[token];
+    if (threshold <= 0)
+      return token;
+  }
+  return candidates.back();  // Only reached through rounding in the bucket sums
 }
 
-void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
+// Top-p among the top K, like top-k followed by top-p in the huggingface samplers: the K come from the raw scores as in
+// SampleTopK, already sorted, and only they get the softmax
+int32_t SampleTopKTopP(std::span<const float> scores, int k, float p, float temperature, Philox4x32 gen, SamplingScratch& scratch) {
   std::uniform_real_distribution<float> dis(0, p);
-  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    if (PadIfAlreadyEOS(batch_id)) {
-      continue;
-    }
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Sort an array of indices into the scores
-    std::vector<int32_t> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::sort(indices.begin(), indices.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = 0;
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < scores.size(); i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
-      break;
-    }
-    SetNextToken(batch_id, token);
+  auto& indices = scratch.candidates;
+  indices.resize(std::min(static_cast<size_t>(k), scores.size()));
+  top_k_indices(indices, scores);
+
+  auto& top_scores = scratch.candidate_scores;
+  top_scores.resize(indices.size());
+  std::transform(indices.begin(), indices.end(), top_scores.begin(), [scores = scores.data()](int32_t i) { return scores[i]; });
+  softmax(top_scores, temperature);
+
+  // Sample a probability threshold
+  float threshold = dis(gen);
+  // Find the first token where the cumulative probability exceeds the threshold
+  for (size_t i = 0; i < indices.size(); i++) {
+    threshold -= top_scores[i];
+    if (threshold <= 0)
+      return indices[i];
   }
-  AppendNextTokensToSequences();
+  return indices.back();  // Only reached through rounding
+}
+
+}  // namespace
+
+void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
+  SelectRows([&](size_t batch_id) {
+    return Generators::SampleTopK(GetScores(static_cast<int>(batch_id)), k, temperature, GetGen(batch_id), scratch_[batch_id]);
+  });
+}
+
+void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
+  SelectRows([&](size_t batch_id) {
+    return Generators::SampleTopP(GetScores(static_cast<int>(batch_id)), p, temperature, GetGen(batch_id), scratch_[batch_id]);
+  });
 }
 
 void GreedySearch_Cpu::SampleTopKTopP(int k, float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
+  SelectRows([&](size_t batch_id) {
+    return Generators::SampleTopKTopP(GetScores(static_cast<int>(batch_id)), k, p, temperature, GetGen(batch_id), scratch_[batch_id]);
+  });
+}
+
+void GreedySearch_Cpu::SelectPerRow() {
+  SelectRows([this](size_t batch_id) {
+    // Same choice as SelectNextTokens, but with the row's options
+    auto& options = params_->GetRowSearch(static_cast<int>(batch_id));
+    std::span<float> const scores = GetScores(static_cast<int>(batch_id));
+    auto gen = GetGen(batch_id);
+    if (!options.do_sample || options.top_k == 1)
+      return TopToken(scores);
+    CheckSamplingOptions(options);
+    if (options.top_p > 0.0f && options.top_p < 1.0f && options.top_k > 1)
+      return Generators::SampleTopKTopP(scores, options.top_k, options.top_p, options.temperature, gen, scratch_[batch_id]);
+    if (options.top_k > 1)
+      return Generators::SampleTopK(scores, options.top_k, options.temperature, gen, scratch_[batch_id]);
+    return Generators::SampleTopP(scores, options.top_p, options.temperature, gen, scratch_[batch_id]);
+  });
+}
+
+void GreedySearch_Cpu::SelectRows(const std::function<int32_t(size_t batch_id)>& select) {
+  ParallelFor(params_->batch_size, params_->search.num_threads, [&](size_t batch_id) {
+    if (!PadIfAlreadyEOS(batch_id))
+      next_tokens_[batch_id] = select(batch_id);
+  });
+
+  // The EOS bookkeeping is shared by the rows, so it's done after. eos_seen_ didn't change, so it still tells which
+  // rows were selected rather than padded.
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    if (PadIfAlreadyEOS(batch_id)) {
-      continue;
-    }
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = indices[k - 1];
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < k; i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
-      break;
-    }
-    SetNextToken(batch_id, token);
+    if (!eos_seen_[batch_id])
+      SetNextToken(batch_id, next_tokens_[batch_id]);
   }
   AppendNextTokensToSequences();
 }
@@ -250,16 +339,47 @@ void GreedySearch_Cpu::SetNextToken(size_t batch_id, int32_t token) {
 
 void GreedySearch_Cpu::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(next_tokens_);
+  UpdateTokenTables(next_tokens_);
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
       Log("hit_max_length", "greedy cpu hit");
     done_ = true;
+    return;
+  }
+
+  // Rows with a shorter max_length of their own are finished like on EOS, so they're padded from here on
+  for (size_t batch_id = 0; batch_id < params_->row_search.size(); batch_id++) {
+    if (eos_seen_[batch_id] || sequences_.GetSequenceLength() < params_->row_search[batch_id].max_length)
+      continue;
+    if (g_log.enabled && g_log.hit_max_length)
+      Log("hit_max_length", "greedy cpu hit on batch " + std::to_string(batch_id));
+    eos_seen_[batch_id] = true;
+    if (--not_done_count_ == 0)
+      done_ = true;
+  }
+}
+
+void GreedySearch_Cpu::AppendTokens(cpu_span<const int32_t> tokens) {
+  assert(params_->BatchBeamSize() == 1);
+  sequences_.AppendTokens(tokens);
+  AddToTokenTables(0, tokens.size());
+  eos_seen_[0] = false;
+  not_done_count_ = 1;
+  done_ = false;
+}
+
+void GreedySearch_Cpu::AppendNextTokens(cpu_span<const int32_t> tokens) {
+  assert(params_->BatchBeamSize() == 1);
+  for (size_t i = 0; i < tokens.size() && !done_; i++) {
+    SetNextToken(0, tokens[i]);
+    AppendNextTokensToSequences();
   }
 }
 
 void BeamSearch_Cpu::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(beam_scorer_->GetNextIndicesCPU(), beam_scorer_->GetNextTokens());
+  UpdateTokenTables(beam_scorer_->GetNextTokens(), beam_scorer_->GetNextIndicesCPU());
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
@@ -278,40 +398,301 @@ std::span<float> Search_Cpu::GetScores(int batch_beam_index) const {
 }
 
 void Search_Cpu::ApplyMinLength(int min_length) {
-  if (sequences_.GetSequenceLength() >= min_length) {
+  const bool per_row = !params_->row_search.empty();
+  if (sequences_.GetSequenceLength() >= min_length && !per_row) {
     return;
   }
 
   const int batch_beam_size = params_->BatchBeamSize();
-  for (int i = 0; i < batch_beam_size; i++) {
-    std::span<float> const beam_token_scores = GetScores(i);
-    beam_token_scores[params_->eos_token_id] = std::numeric_limits<float>::lowest();
-  }
+  for (int i = 0; i < batch_beam_size; i++)
+    ApplyMinLengthToRow(i, per_row ? params_->GetRowSearch(i).min_length : min_length);
 }
 
 void Search_Cpu::ApplyRepetitionPenalty(float penalty) {
-  if (penalty == 1.0f)
+  if (!PrepareRepetitionPenalty(penalty))
+    return;
+
+  const bool per_row = !params_->row_search.empty();  // Only with greedy search, so there's one beam per row
+  ParallelFor(params_->BatchBeamSize(), params_->search.num_threads, [&](size_t row) {
+    const int i = static_cast<int>(row);
+    ApplyRepetitionPenaltyToRow(i, per_row ? params_->GetRowSearch(i).repetition_penalty : penalty);
+  });
+}
+
+void Search_Cpu::ApplyNoRepeatNgram(int ngram_size) {
+  if (!PrepareNoRepeatNgram(ngram_size))
     return;
 
   const int batch_beam_size = params_->BatchBeamSize();
-  for (int i = 0; i < batch_beam_size; i++) {
-    std::span<float> const beam_token_scores = GetScores(i);
-    std::span<const int32_t> const sequence = sequences_.GetSequence(i);
-
-    // Find unique word IDs in sequence.
-    std::unordered_set<int32_t> unique_word_ids;
-    for (const auto& word_id : sequence) {
-      unique_word_ids.insert(word_id);
+  for (int i = 0; i < batch_beam_size; i++)
+    ApplyNoRepeatNgramToRow(i);
+}
+
+void Search_Cpu::ProcessLogits() {
+  auto& search = params_->search;
+  const bool repetition_penalty = PrepareRepetitionPenalty(search.repetition_penalty);
+  const bool no_repeat_ngram = PrepareNoRepeatNgram(search.no_repeat_ngram_size);
+
+  // Every stage on one row, then the next row, rather than each stage making its own pass over all of the rows
+  ParallelFor(params_->BatchBeamSize(), search.num_threads, [&](size_t row) {
+    const int i = static_cast<int>(row);
+    auto& options = params_->GetRowSearch(i);
+    ApplyMinLengthToRow(i, options.min_length);
+    if (repetition_penalty)
+      ApplyRepetitionPenaltyToRow(i, options.repetition_penalty);
+    if (no_repeat_ngram)
+      ApplyNoRepeatNgramToRow(i);
+    for (auto& processor : params_->logits_processors)
+      processor->Process(i, sequences_.GetSequence(i), GetScores(i));
+  });
+}
+
+void Search_Cpu::ApplyMinLengthToRow(int row, int min_length) {
+  if (sequences_.GetSequenceLength() < min_length)
+    GetScores(row)[params_->eos_token_id] = std::numeric_limits<float>::lowest();
+}
+
+bool Search_Cpu::PrepareRepetitionPenalty(float penalty) {
+  const bool per_row = !params_->row_search.empty();  // Only with greedy search, so there's one beam per row
+  if (penalty == 1.0f && !per_row)
+    return false;
+
+  if (seen_tokens_.empty()) {
+    // From here on the sequences' tokens are added as they're appended
+    const int batch_beam_size = params_->BatchBeamSize();
+    seen_tokens_.resize(batch_beam_size);
+    for (int i = 0; i < batch_beam_size; i++) {
+      seen_tokens_[i].bits.resize((params_->vocab_size + 63) / 64);
+      for (auto token : sequences_.GetSequence(i))
+        seen_tokens_[i].Insert(token);
     }
+  }
+  return true;
+}
+
+void Search_Cpu::ApplyRepetitionPenaltyToRow(int row, float penalty) {
+  if (penalty == 1.0f)
+    return;
+  std::span<float> const beam_token_scores = GetScores(row);
 
-    for (const int32_t word_id : unique_word_ids) {
-      float const score = beam_token_scores[word_id];
+  for (const int32_t word_id : seen_tokens_[row].tokens) {
+    float const score = beam_token_scores[word_id];
 
-      // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
-      // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
-      beam_token_scores[word_id] = (score < 0 ? score * penalty : score / penalty);
+    // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
+    // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
+    beam_token_scores[word_id] = (score < 0 ? score * penalty : score / penalty);
+  }
+}
+
+bool Search_Cpu::PrepareNoRepeatNgram(int ngram_size) {
+  const bool per_row = !params_->row_search.empty();  // Only with greedy search, so there's one beam per row
+  if (ngram_size == 0 && !per_row)
+    return false;
+
+  if (ngram_indices_.empty()) {
+    // From here on the sequences' tokens are added as they're appended
+    const int beam_count = params_->search.num_beams;
+    std::vector<std::span<const int32_t>> beam_sequences(beam_count);
+    for (int batch = 0; batch < params_->batch_size; batch++) {
+      for (int beam = 0; beam < beam_count; beam++)
+        beam_sequences[beam] = sequences_.GetSequence(batch * beam_count + beam);
+      ngram_indices_.emplace_back(per_row ? params_->GetRowSearch(batch).no_repeat_ngram_size : ngram_size, beam_sequences);
+    }
+  }
+  return true;
+}
+
+void Search_Cpu::ApplyNoRepeatNgramToRow(int row) {
+  const int beam_count = params_->search.num_beams;
+  ngram_indices_[row / beam_count].Ban(row % beam_count, GetScores(row));
+}
+
+void Search_Cpu::SeenTokens::Insert(int32_t token) {
+  const size_t word = static_cast<uint32_t>(token) / 64;
+  const uint64_t mask = uint64_t{1} << (token % 64);
+  if (word >= bits.size() || (bits[word] & mask))
+    return;  // Already seen, or outside of the vocabulary
+  bits[word] |= mask;
+  tokens.push_back(token);
+}
+
+namespace {
+constexpr uint64_t ngram_hash_base = 0x100000001B3ull;  // Odd, so invertible mod 2^64 and no token's weight vanishes
+}
+
+Search_Cpu::NgramIndex::NgramIndex(int ngram_size, std::span<const std::span<const int32_t>> beam_sequences)
+    : ngram_size{ngram_size},
+      beam_count{static_cast<int>(beam_sequences.size())},
+      length{static_cast<int>(beam_sequences[0].size())} {
+  if (ngram_size < 0)
+    throw std::runtime_error("no_repeat_ngram_size must be 0 or greater, is " + std::to_string(ngram_size));
+
+  // The tokens every beam has in common are the trunk, after it each beam is treated as a path of its own
+  auto first = beam_sequences[0];
+  int common_length = length;
+  for (auto sequence : beam_sequences.subspan(1))
+    common_length = static_cast<int>(std::mismatch(first.begin(), first.begin() + common_length, sequence.begin()).first - first.begin());
+  trunk_step = common_length - 1;
+  if (ngram_size == 0)
+    return;
+
+  const int window = ngram_size - 1;
+  for (int step = window; step < common_length; step++) {
+    auto& tokens = followers[Hash(first.subspan(step - window, window))];
+    if (std::none_of(tokens.begin(), tokens.end(), [&](const Follower& v) { return v.token == first[step]; }))
+      tokens.push_back({first[step], step, 0});
+  }
+  for (int step = std::max(common_length, window); step < length; step++) {
+    for (int beam = 0; beam < beam_count; beam++) {
+      auto sequence = beam_sequences[beam];
+      Follower follower{sequence[step], step, beam};
+      auto hash = Hash(sequence.subspan(step - window, window));
+      followers[hash].push_back(follower);
+      pending.emplace_back(hash, follower);
     }
   }
+  for (int step = common_length; step < length; step++) {
+    for (int beam = 0; beam < beam_count; beam++)
+      parents.push_back(beam);
+  }
+
+  // Right aligned, the window is only used once it's full
+  windows.resize(static_cast<size_t>(window) * beam_count);
+  next_windows.resize(windows.size());
+  for (int beam = 0; beam < beam_count; beam++) {
+    auto last = beam_sequences[beam].last(std::min(length, window));
+    std::copy(last.begin(), last.end(), windows.begin() + (beam + 1) * window - last.size());
+  }
+}
+
+uint64_t Search_Cpu::NgramIndex::Hash(std::span<const int32_t> tokens) {
+  uint64_t hash{};
+  for (auto token : tokens)
+    hash = hash * ngram_hash_base + static_cast<uint64_t>(token) + 1;
+  return hash;
+}
+
+void Search_Cpu::NgramIndex::Append(std::span<const int32_t> tokens, std::span<const int32_t> parent_indices) {
+  if (ngram_size == 0)
+    return;
+  const int step = length++;
+  const size_t window = ngram_size - 1;
+
+  for (int beam = 0; beam < beam_count; beam++) {
+    const int32_t parent = parent_indices.empty() ? beam : parent_indices[beam] % beam_count;
+    auto parent_window = std::span<const int32_t>{windows}.subspan(parent * window, window);
+
+    // The parent's last n-1 tokens are complete, so the token can't follow them again on this path
+    if (step >= static_cast<int>(window)) {
+      Follower follower{tokens[beam], step, beam};
+      auto hash = Hash(parent_window);
+      followers[hash].push_back(follower);
+      pending.emplace_back(hash, follower);
+    }
+
+    if (window != 0) {
+      auto next = std::copy(parent_window.begin() + 1, parent_window.end(), next_windows.begin() + beam * window);
+      *next = tokens[beam];
+    }
+    parents.push_back(parent);
+  }
+  std::swap(windows, next_windows);
+  AdvanceTrunk();
+}
+
+void Search_Cpu::NgramIndex::AdvanceTrunk() {
+  // Walk every beam's path back until they meet, where they meet is the new trunk
+  nodes.resize(beam_count);
+  std::iota(nodes.begin(), nodes.end(), 0);
+  int step = length - 1;
+  for (; step > trunk_step; step--) {
+    if (std::all_of(nodes.begin(), nodes.end(), [&](int32_t node) { return node == nodes[0]; }))
+      break;
+    auto* step_parents = GetParents(step);
+    for (auto& node : nodes)
+      node = step_parents[node];
+  }
+  if (step == trunk_step)
+    return;
+
+  // Followers up to the new trunk are either on it, so on every beam's path from now on, or on a path that ended
+  nodes.resize(step - trunk_step);
+  for (int32_t node = nodes[0], s = step; s > trunk_step; s--) {
+    nodes[s - trunk_step - 1] = node;
+    node = GetParents(s)[node];
+  }
+  auto shared_end = std::find_if(pending.begin(), pending.end(), [&](auto& v) { return v.second.step > step; });
+  for (auto it = pending.begin(); it != shared_end; ++it) {
+    auto& [hash, follower] = *it;
+    auto& tokens = followers[hash];
+    const bool on_trunk = follower.beam == nodes[follower.step - trunk_step - 1];
+    // Everything earlier than the follower is on the trunk by now, so it's a duplicate if the token is there already
+    if (on_trunk && std::none_of(tokens.begin(), tokens.end(), [&](const Follower& v) { return v.token == follower.token && v.step < follower.step; }))
+      continue;
+    tokens.erase(std::find_if(tokens.begin(), tokens.end(), [&](const Follower& v) { return v.step == follower.step && v.beam == follower.beam; }));
+    if (tokens.empty())
+      followers.erase(hash);
+  }
+  pending.erase(pending.begin(), shared_end);
+  parents.erase(parents.begin(), parents.begin() + static_cast<size_t>(step - trunk_step) * beam_count);
+  trunk_step = step;
+}
+
+void Search_Cpu::NgramIndex::Ban(int beam, std::span<float> scores) const {
+  const int window = ngram_size - 1;
+  if (ngram_size == 0 || length < window)
+    return;
+  auto it = followers.find(Hash(std::span<const int32_t>{windows}.subspan(beam * window, window)));
+  if (it == followers.end())
+    return;
+
+  // Newest first, so the beam's path is walked back only once, and only as far as the trunk
+  int32_t node = beam;
+  int step = length - 1;
+  for (auto follower = it->second.rbegin(); follower != it->second.rend(); ++follower) {
+    if (follower->step > trunk_step) {
+      for (; step > follower->step; step--)
+        node = GetParents(step)[node];
+      if (node != follower->beam)
+        continue;
+    }
+    scores[follower->token] = std::numeric_limits<float>::lowest();
+  }
+}
+
+void Search_Cpu::UpdateTokenTables(std::span<const int32_t> next_tokens, std::span<const int32_t> beam_indices) {
+  if (beam_indices.empty()) {
+    for (size_t i = 0; i < seen_tokens_.size(); i++)
+      seen_tokens_[i].Insert(next_tokens[i]);
+    for (size_t i = 0; i < ngram_indices_.size(); i++)
+      ngram_indices_[i].Append(next_tokens.subspan(i, 1), {});
+    return;
+  }
+
+  // Each beam continues some beam of the previous step, so starts from a copy of its seen tokens. The assignments reuse
+  // the buffers of seen_tokens_next_, so after the first step they don't allocate.
+  if (!seen_tokens_.empty()) {
+    seen_tokens_next_.resize(seen_tokens_.size());
+    for (size_t i = 0; i < seen_tokens_.size(); i++) {
+      seen_tokens_next_[i] = seen_tokens_[beam_indices[i]];
+      seen_tokens_next_[i].Insert(next_tokens[i]);
+    }
+    std::swap(seen_tokens_, seen_tokens_next_);
+  }
+  // The beams of a batch entry share an index, which only needs each beam's new token
+  const size_t beam_count = params_->search.num_beams;
+  for (size_t i = 0; i < ngram_indices_.size(); i++)
+    ngram_indices_[i].Append(next_tokens.subspan(i * beam_count, beam_count), beam_indices.subspan(i * beam_count, beam_count));
+}
+
+void Search_Cpu::AddToTokenTables(int row, size_t count) {
+  auto sequence = sequences_.GetSequence(row);
+  for (size_t i = sequence.size() - count; i < sequence.size(); i++) {
+    if (!seen_tokens_.empty())
+      seen_tokens_[row].Insert(sequence[i]);
+    if (!ngram_indices_.empty())
+      ngram_indices_[row].Append(sequence.subspan(i, 1), {});
+  }
 }
 
 }  // namespace Generators
\ No newline at end of file
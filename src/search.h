@@ -1,4 +1,5 @@
 #include "sequences.h"
+#include "philox.h"
 #include <random>
 
 namespace Generators {
@@ -25,10 +26,25 @@ struct Search {
   virtual void SampleTopP(float /*p*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopK(int /*k*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) { assert(false); }
+  // Picks each row's next token using that row's GeneratorParams::GetRowSearch options
+  virtual void SelectPerRow() { throw std::runtime_error("Per row search options are only supported by the CPU greedy search"); }
 
   // Scoring features
   virtual void ApplyMinLength(int min_length) = 0;
   virtual void ApplyRepetitionPenalty(float penalty) = 0;
+  virtual void ApplyNoRepeatNgram(int /*ngram_size*/) {}  // Only implemented by the CPU searches
+
+  // Runs all of the above as set in the params, then the params' logits_processors (CPU only)
+  virtual void ProcessLogits() {
+    ApplyMinLength(params_->search.min_length);
+    ApplyRepetitionPenalty(params_->search.repetition_penalty);
+    ApplyNoRepeatNgram(params_->search.no_repeat_ngram_size);
+  }
+
+  // Appends tokens to a single sequence and restarts the search if it was done
+  virtual void AppendTokens(cpu_span<const int32_t> /*tokens*/) { throw std::runtime_error("Appending tokens is only supported by the CPU greedy search"); }
+  // Adds several generated tokens to a single sequence as if each was picked by its own step, stopping at EOS or max_length
+  virtual void AppendNextTokens(cpu_span<const int32_t> /*tokens*/) { throw std::runtime_error("Speculative decoding is only supported by the CPU greedy search"); }
 
   std::shared_ptr<const GeneratorParams> params_;
 };
@@ -45,6 +61,8 @@ struct Search_Cpu : Search {
 
   void ApplyMinLength(int min_length) override;
   void ApplyRepetitionPenalty(float penalty) override;
+  void ApplyNoRepeatNgram(int ngram_size) override;
+  void ProcessLogits() override;
 
   std::span<float> GetScores(int batch_beam_index) const;
   Sequences& GetSequences() { return sequences_; }
@@ -58,6 +76,72 @@ struct Search_Cpu : Search {
 
   Sequences sequences_;
   bool done_{};
+
+ protected:
+  // The built-in processing of a single row, the Prepare* methods first build the tables they need and return false
+  // when no row uses them
+  void ApplyMinLengthToRow(int row, int min_length);
+  bool PrepareRepetitionPenalty(float penalty);
+  void ApplyRepetitionPenaltyToRow(int row, float penalty);
+  bool PrepareNoRepeatNgram(int ngram_size);
+  void ApplyNoRepeatNgramToRow(int row);
+
+  // The distinct tokens in a row's sequence, so the repetition penalty doesn't rescan the whole sequence every step
+  struct SeenTokens {
+    void Insert(int32_t token);
+
+    std::vector<uint64_t> bits;   // One bit per vocabulary entry
+    std::vector<int32_t> tokens;  // The set bits, in the order first seen
+  };
+
+  // The tokens that followed each (n-1)-gram, keyed by a hash of the (n-1)-gram, so the tokens no_repeat_ngram_size
+  // bans after a beam's last n-1 tokens are a single lookup. The beams of a batch entry share one index, where each
+  // follower records the step & beam of its token, so a step only adds a follower per beam and never copies history.
+  // Up to the trunk (the last step every beam's path goes through) followers off the trunk are dropped, so only the
+  // followers after it are checked against the beam's path.
+  struct NgramIndex {
+    NgramIndex(int ngram_size, std::span<const std::span<const int32_t>> beam_sequences);
+
+    // Adds the token each beam got on the next step. parents are the batch_beam indices of the beams they continue,
+    // empty when every beam continues itself.
+    void Append(std::span<const int32_t> tokens, std::span<const int32_t> parents);
+    void Ban(int beam, std::span<float> scores) const;  // Sets the scores of the tokens the beam can't get next to lowest
+
+    struct Follower {
+      int32_t token;
+      int step;      // Where token is in the sequence
+      int32_t beam;  // Which beam got token on that step
+    };
+
+    static uint64_t Hash(std::span<const int32_t> tokens);
+    const int32_t* GetParents(int step) const { return parents.data() + static_cast<size_t>(step - trunk_step - 1) * beam_count; }
+    void AdvanceTrunk();
+
+    int ngram_size;
+    int beam_count;
+    int length;                                  // Of the sequences
+    int trunk_step;                              // -1 when the beams share no tokens
+    std::vector<int32_t> windows, next_windows;  // The last ngram_size - 1 tokens of each beam
+    std::vector<int32_t> parents;                // For each step after the trunk, the beam each beam continued
+    std::vector<int32_t> nodes;                  // AdvanceTrunk scratch
+    std::unordered_map<uint64_t, std::vector<Follower>> followers;  // Each in step order
+    std::vector<std::pair<uint64_t, Follower>> pending;             // Followers after the trunk & their hash, in step order
+  };
+
+  // Keep seen_tokens_ & ngram_indices_ in step with the sequences, called after appending the next tokens to them. For
+  // beam search, beam_indices are the rows the new rows continue from.
+  void UpdateTokenTables(std::span<const int32_t> next_tokens, std::span<const int32_t> beam_indices = {});
+  void AddToTokenTables(int row, size_t count);  // After count tokens were appended to the row
+
+  std::vector<SeenTokens> seen_tokens_, seen_tokens_next_;  // Per row, built by the first repetition penalty applied
+  std::vector<NgramIndex> ngram_indices_;  // Per batch entry, built by the first ApplyNoRepeatNgram
+};
+
+// Buffers reused by the CPU samplers from one step to the next, so sampling doesn't allocate per token
+struct SamplingScratch {
+  std::vector<float> bucket_mass;
+  std::vector<int32_t> candidates;
+  std::vector<float> candidate_scores;
 };
 
 struct GreedySearch_Cpu : Search_Cpu {
@@ -70,11 +154,19 @@ struct GreedySearch_Cpu : Search_Cpu {
   void SampleTopK(int k, float temperature) override;
   void SampleTopP(float p, float temperature) override;
   void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) override;
+  void SelectPerRow() override;
+
+  void AppendTokens(cpu_span<const int32_t> tokens) override;
+  void AppendNextTokens(cpu_span<const int32_t> tokens) override;
 
  private:
   bool PadIfAlreadyEOS(size_t batch_id);
   void SetNextToken(size_t batch_id, int32_t token);
   void AppendNextTokensToSequences();
+  // Sets the next token of every unfinished row to select(batch_id), split across search.num_threads threads
+  void SelectRows(const std::function<int32_t(size_t batch_id)>& select);
+  // The random engine for a row's draws on this step, the same however the rows are split across threads
+  Philox4x32 GetGen(size_t batch_id) const { return {seeds_[batch_id], static_cast<uint32_t>(batch_id), static_cast<uint32_t>(sequences_.GetSequenceLength())}; }
 
   std::unique_ptr<int32_t[]> next_tokens_buffer_;
   std::unique_ptr<int32_t[]> temp_topk_buffer_;
@@ -83,7 +175,8 @@ struct GreedySearch_Cpu : Search_Cpu {
   std::unique_ptr<bool[]> eos_seen_buffer_;
   int not_done_count_{params_->batch_size};  // When zero, every batch entry is done (starts at batch_size_)
 
-  std::mt19937 gen_;
+  std::vector<uint64_t> seeds_;  // Per row, as GeneratorParams::row_search can give each row its own random_seed
+  std::vector<SamplingScratch> scratch_;  // One per row, so rows can be sampled in parallel
 };
 
 struct BeamSearch_Cpu : Search_Cpu {
@@ -13,21 +13,27 @@ Sequences::Sequences(std::span<const int32_t> input_sequences, int batch_size, i
   assert(current_length_ * batch_size == input_sequences.size());  // Ensure size divided perfectly
   const size_t sequences_size = static_cast<size_t>(batch_beam_size_) * max_length;
 
-  if (beam_size == 1) {
-    sequences_buffer_ = std::make_unique<int32_t[]>(sequences_size);
-    sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
-  } else {
-    sequences_buffer_ = std::make_unique<int32_t[]>(2 * sequences_size);
-    sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
-    sequences_next_ = cpu_span<int32_t>(sequences_buffer_.get() + sequences_size, sequences_size);
+  sequences_buffer_ = std::make_unique<int32_t[]>(sequences_size);
+  sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
+  if (beam_size != 1) {
+    step_tokens_ = std::make_unique<int32_t[]>(sequences_size);
+    step_parents_ = std::make_unique<int32_t[]>(sequences_size);
+    sequence_beams_ = std::make_unique<int32_t[]>(sequences_size);
+    materialized_lengths_.resize(batch_beam_size_, current_length_);
   }
 
   // The original inputs are not expanded, this expands them in place into the sequences
   for (size_t batch = 0; batch < batch_size; batch++) {
     for (size_t beam = 0; beam < beam_size; beam++) {
+      const size_t batch_beam_index = batch * beam_size + beam;
       for (int j = 0; j < current_length_; j++) {
-        sequences_[(batch * beam_size + beam) * max_length + j] =
+        sequences_[batch_beam_index * max_length + j] =
             static_cast<int32_t>(input_sequences[batch * current_length_ + j]);
+        if (beam_size != 1) {
+          step_tokens_[j * batch_beam_size_ + batch_beam_index] = sequences_[batch_beam_index * max_length + j];
+          step_parents_[j * batch_beam_size_ + batch_beam_index] = static_cast<int32_t>(batch_beam_index);
+          sequence_beams_[batch_beam_index * max_length + j] = static_cast<int32_t>(batch_beam_index);
+        }
       }
     }
   }
@@ -35,28 +41,42 @@ Sequences::Sequences(std::span<const int32_t> input_sequences, int batch_size, i
 
 cpu_span<int32_t> Sequences::GetSequence(int batch_beam_index) {
   auto span = sequences_.subspan(batch_beam_index * max_length_, current_length_);
+
+  if (step_tokens_ && materialized_lengths_[batch_beam_index] != current_length_) {
+    // Walk back through the parents, until the path is one the row already holds
+    const int materialized_length = materialized_lengths_[batch_beam_index];
+    auto* beams = sequence_beams_.get() + batch_beam_index * max_length_;
+    int32_t beam = batch_beam_index;
+    for (int step = current_length_ - 1; step >= 0; step--) {
+      if (step < materialized_length && beams[step] == beam)
+        break;
+      span[step] = step_tokens_[step * batch_beam_size_ + beam];
+      beams[step] = beam;
+      beam = step_parents_[step * batch_beam_size_ + beam];
+    }
+    materialized_lengths_[batch_beam_index] = current_length_;
+  }
+
   return cpu_span<int32_t>{span.data(), span.size()};
 }
 
+cpu_span<int32_t> Sequences::GetSequences() {
+  if (step_tokens_) {
+    for (int i = 0; i < batch_beam_size_; i++)
+      GetSequence(i);
+  }
+  return sequences_;
+}
+
 int Sequences::GetSequenceLength() const {
   return current_length_;
 }
 
 void Sequences::AppendNextTokenToSequences(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens) {
-  for (ptrdiff_t i = 0; i < batch_beam_size_; i++) {
-    int batch_beam_index = batch_beam_indices[i];
-    std::span<const int32_t> source = sequences_.subspan(batch_beam_index * max_length_, current_length_);
-    std::span<int32_t> target = sequences_next_.subspan(i * max_length_, current_length_);
-    copy(source, target);
-
-    // Append next token to each beam.
-    sequences_next_[i * max_length_ + current_length_] = batch_beam_next_tokens[i];
-  }
-
+  assert(step_tokens_ && current_length_ < max_length_);
+  copy(batch_beam_next_tokens, std::span<int32_t>{step_tokens_.get() + current_length_ * batch_beam_size_, static_cast<size_t>(batch_beam_size_)});
+  copy(batch_beam_indices, std::span<int32_t>{step_parents_.get() + current_length_ * batch_beam_size_, static_cast<size_t>(batch_beam_size_)});
   ++current_length_;
-
-  // Rotate buffer for next round.
-  std::swap(sequences_, sequences_next_);
 }
 
 void Sequences::AppendNextTokenToSequences(std::span<const int32_t> next_tokens) {
@@ -73,4 +93,10 @@ void Sequences::AppendNextTokenToSequences(std::span<const int32_t> next_tokens)
   ++current_length_;
 }
 
+void Sequences::AppendTokens(std::span<const int32_t> tokens) {
+  assert(batch_beam_size_ == 1 && current_length_ + tokens.size() <= static_cast<size_t>(max_length_));
+  copy(tokens, sequences_.subspan(current_length_, tokens.size()));
+  current_length_ += static_cast<int>(tokens.size());
+}
+
 }  // namespace Generators
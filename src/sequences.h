@@ -2,31 +2,42 @@
 namespace Generators {
 
 // This class keeps track of sequences generated.
+// Beam search only records each step's token and parent beam (a trellis), and a beam's sequence is written out by
+// walking back through its parents when asked for. The walk stops where the path joins what that beam's row already
+// holds, so asking every step costs about as many tokens as the beam's path changed by.
 struct Sequences {
   Sequences(std::span<const int32_t> input_sequence, int batch_size, int beam_size, int max_length);
 
   // Returns a sequence of word IDs for a given beam index ( beam_index < batch_beam_size).
+  // Different beam indices can be requested from different threads at once.
   cpu_span<int32_t> GetSequence(int batch_beam_index);
-  cpu_span<int32_t> GetSequences() { return sequences_; }
+  cpu_span<int32_t> GetSequences();
 
   // Returns current sequence length.
   int GetSequenceLength() const;
 
   // Used by Beam search:
-  // Shuffles sequences around based on batch_beam_indices, then append next token to selected sequences.
+  // Appends the next token of each beam, batch_beam_indices being the beam each one continues.
   void AppendNextTokenToSequences(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens);
 
   // Used by Greedy search:
   void AppendNextTokenToSequences(std::span<const int32_t> next_tokens);
 
+  // Appends several tokens to a single sequence (batch_beam_size of 1), as when resuming a generator with new input
+  void AppendTokens(std::span<const int32_t> tokens);
+
  private:
   std::unique_ptr<int32_t[]> sequences_buffer_;
 
-  // Two buffers of shape (batch_size, num_beams, max_seq_length) to store sequences.
-  // At each time, there is only one buffer is active. The other one will be active in next token.
-  // Each AppendNextTokenToSequences call will trigger a rotation of active buffer.
+  // Shape (batch_size, num_beams, max_seq_length). For greedy search the sequences themselves, for beam search each
+  // beam's sequence as of the last time it was requested.
   cpu_span<int32_t> sequences_;
-  cpu_span<int32_t> sequences_next_;  // This only exists for beam search, to allow for the easy reordering of sequences
+
+  // Beam search only, all of shape (max_seq_length, batch_beam_size) besides materialized_lengths_
+  std::unique_ptr<int32_t[]> step_tokens_;     // The token each beam got on each step
+  std::unique_ptr<int32_t[]> step_parents_;    // The beam each beam continued on each step, itself in the prompt
+  std::unique_ptr<int32_t[]> sequence_beams_;  // For each row of sequences_, the beam its token came from on each step
+  std::vector<int> materialized_lengths_;      // How much of each row of sequences_ is up to date
 
   int batch_beam_size_;
   int max_length_;
@@ -2,7 +2,8 @@
 
 namespace Generators {
 
-void softmax(std::span<float> values);
+// Vectorized with AVX2 or AVX-512 when the CPU supports it, using a fast exp approximation (relative error ~1e-7)
+void softmax(std::span<float> values, float temperature = 1.0f);  // softmax of values / temperature
 void log_softmax(std::span<float> values);
 
 }  // namespace Generators
@@ -1,22 +1,226 @@
 #include "generators.h"
+#include "softmax.h"
+#include "cpu_features.h"
+#include <limits>
 
 namespace Generators {
 
-void softmax(std::span<float> values) {
-  float max = *std::max_element(values.data(), values.data() + values.size());
-  std::transform(values.begin(), values.end(), values.begin(), [max](float v) { return std::exp(v - max); });
-  float sum = std::accumulate(values.begin(), values.end(), 0.0f);
-  std::transform(values.begin(), values.end(), values.begin(), [sum](float v) { return v / sum; });
+namespace {
+
+// exp(x) as 2^n * e^r with r = x - n * ln(2) in [-ln(2)/2, ln(2)/2], e^r being the Cephes expf polynomial. The relative
+// error is around 1e-7, and x is clamped so 2^n stays a normal float. Below exp_lo the result is exactly 0, so tokens
+// banned with lowest() or -inf get no probability. Every kernel uses the same steps so they agree.
+constexpr float exp_lo = -87.3f, exp_hi = 88.3762626647950f;
+constexpr float log2e = 1.44269504088896341f;
+constexpr float ln2_hi = 0.693359375f, ln2_lo = -2.12194440e-4f;
+constexpr float exp_p0 = 1.9875691500E-4f, exp_p1 = 1.3981999507E-3f, exp_p2 = 8.3334519073E-3f,
+                exp_p3 = 4.1665795894E-2f, exp_p4 = 1.6666665459E-1f, exp_p5 = 5.0000001201E-1f;
+
+float FastExp(float x) {
+  if (x < exp_lo)
+    return 0.0f;
+  x = std::min(x, exp_hi);
+  const float n = std::floor(x * log2e + 0.5f);
+  x = x - n * ln2_hi - n * ln2_lo;
+  float y = exp_p0;
+  y = y * x + exp_p1;
+  y = y * x + exp_p2;
+  y = y * x + exp_p3;
+  y = y * x + exp_p4;
+  y = y * x + exp_p5;
+  y = y * x * x + x + 1.0f;
+
+  const int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return y * scale;
 }
 
-void log_softmax(std::span<float> values) {
-  float max = *std::max_element(values.data(), values.data() + values.size());
-  std::vector<float> scaled(values.begin(), values.end());
-  std::transform(values.begin(), values.end(), scaled.begin(), [max](float v) { return std::exp(v - max); });
+// The three passes of a softmax: the max, exp((v - max) * scale) stored back along with its sum, then the normalize
+struct Kernels {
+  float (*max)(const float* values, size_t count);
+  float (*exp_sum)(float* values, size_t count, float max, float scale, bool store);
+  void (*multiply)(float* values, size_t count, float factor);
+};
+
+float MaxScalar(const float* values, size_t count) {
+  return *std::max_element(values, values + count);
+}
+
+float ExpSumScalar(float* values, size_t count, float max, float scale, bool store) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < count; i++) {
+    float v = FastExp((values[i] - max) * scale);
+    if (store)
+      values[i] = v;
+    sum += v;
+  }
+  return sum;
+}
+
+void MultiplyScalar(float* values, size_t count, float factor) {
+  for (size_t i = 0; i < count; i++)
+    values[i] *= factor;
+}
+
+#if CPU_X86
+
+TARGET_AVX2 inline __m256 FastExp256(__m256 x) {
+  const __m256 underflow = _mm256_cmp_ps(x, _mm256_set1_ps(exp_lo), _CMP_LT_OQ);
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(exp_lo)), _mm256_set1_ps(exp_hi));
+  const __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(log2e), _mm256_set1_ps(0.5f)));
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_hi), x);
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_lo), x);
+  __m256 y = _mm256_set1_ps(exp_p0);
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(exp_p1));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(exp_p2));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(exp_p3));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(exp_p4));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(exp_p5));
+  y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+  const __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_andnot_ps(underflow, _mm256_mul_ps(y, _mm256_castsi256_ps(bits)));
+}
+
+TARGET_AVX2 float HorizontalSum256(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+TARGET_AVX2 float MaxAvx2(const float* values, size_t count) {
+  size_t i = 0;
+  float max = std::numeric_limits<float>::lowest();
+  if (count >= 8) {
+    __m256 max8 = _mm256_loadu_ps(values);
+    for (i = 8; i + 8 <= count; i += 8)
+      max8 = _mm256_max_ps(max8, _mm256_loadu_ps(values + i));
+    __m128 max4 = _mm_max_ps(_mm256_castps256_ps128(max8), _mm256_extractf128_ps(max8, 1));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+    max = _mm_cvtss_f32(max4);
+  }
+  for (; i < count; i++)
+    max = std::max(max, values[i]);
+  return max;
+}
+
+TARGET_AVX2 float ExpSumAvx2(float* values, size_t count, float max, float scale, bool store) {
+  const __m256 max8 = _mm256_set1_ps(max), scale8 = _mm256_set1_ps(scale);
+  __m256 sum8 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 v = FastExp256(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(values + i), max8), scale8));
+    if (store)
+      _mm256_storeu_ps(values + i, v);
+    sum8 = _mm256_add_ps(sum8, v);
+  }
+  return HorizontalSum256(sum8) + ExpSumScalar(values + i, count - i, max, scale, store);
+}
 
-  float sum = std::accumulate(scaled.begin(), scaled.end(), 0.0f);
-  float log_max = std::log(sum);
-  std::transform(values.begin(), values.end(), values.begin(), [max, log_max](float v) { return v - max - log_max; });
+TARGET_AVX2 void MultiplyAvx2(float* values, size_t count, float factor) {
+  const __m256 factor8 = _mm256_set1_ps(factor);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_ps(values + i, _mm256_mul_ps(_mm256_loadu_ps(values + i), factor8));
+  MultiplyScalar(values + i, count - i, factor);
+}
+
+TARGET_AVX512 inline __m512 FastExp512(__m512 x) {
+  const __mmask16 in_range = _mm512_cmp_ps_mask(x, _mm512_set1_ps(exp_lo), _CMP_NLT_UQ);
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(exp_lo)), _mm512_set1_ps(exp_hi));
+  const __m512 n = _mm512_roundscale_ps(_mm512_fmadd_ps(x, _mm512_set1_ps(log2e), _mm512_set1_ps(0.5f)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_hi), x);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_lo), x);
+  __m512 y = _mm512_set1_ps(exp_p0);
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(exp_p1));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(exp_p2));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(exp_p3));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(exp_p4));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(exp_p5));
+  y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+  const __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127)), 23);
+  return _mm512_maskz_mul_ps(in_range, y, _mm512_castsi512_ps(bits));
+}
+
+// The AVX-512 kernels handle the tail with masked loads & stores rather than scalar code
+TARGET_AVX512 inline __mmask16 TailMask(size_t count) {
+  return static_cast<__mmask16>((1u << count) - 1);
+}
+
+TARGET_AVX512 float MaxAvx512(const float* values, size_t count) {
+  __m512 max16 = _mm512_set1_ps(std::numeric_limits<float>::lowest());
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+    max16 = _mm512_max_ps(max16, _mm512_loadu_ps(values + i));
+  if (i < count)
+    max16 = _mm512_mask_max_ps(max16, TailMask(count - i), max16, _mm512_maskz_loadu_ps(TailMask(count - i), values + i));
+  return _mm512_reduce_max_ps(max16);
+}
+
+TARGET_AVX512 float ExpSumAvx512(float* values, size_t count, float max, float scale, bool store) {
+  const __m512 max16 = _mm512_set1_ps(max), scale16 = _mm512_set1_ps(scale);
+  __m512 sum16 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 v = FastExp512(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(values + i), max16), scale16));
+    if (store)
+      _mm512_storeu_ps(values + i, v);
+    sum16 = _mm512_add_ps(sum16, v);
+  }
+  if (i < count) {
+    const __mmask16 mask = TailMask(count - i);
+    __m512 v = FastExp512(_mm512_mul_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, values + i), max16), scale16));
+    if (store)
+      _mm512_mask_storeu_ps(values + i, mask, v);
+    sum16 = _mm512_mask_add_ps(sum16, mask, sum16, v);
+  }
+  return _mm512_reduce_add_ps(sum16);
+}
+
+TARGET_AVX512 void MultiplyAvx512(float* values, size_t count, float factor) {
+  const __m512 factor16 = _mm512_set1_ps(factor);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16)
+    _mm512_storeu_ps(values + i, _mm512_mul_ps(_mm512_loadu_ps(values + i), factor16));
+  if (i < count) {
+    const __mmask16 mask = TailMask(count - i);
+    _mm512_mask_storeu_ps(values + i, mask, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, values + i), factor16));
+  }
+}
+
+#endif
+
+const Kernels& GetKernels() {
+  static const Kernels kernels = [] {
+#if CPU_X86
+    if (GetCpuFeatures().avx512)
+      return Kernels{MaxAvx512, ExpSumAvx512, MultiplyAvx512};
+    if (GetCpuFeatures().avx2)
+      return Kernels{MaxAvx2, ExpSumAvx2, MultiplyAvx2};
+#endif
+    return Kernels{MaxScalar, ExpSumScalar, MultiplyScalar};
+  }();
+  return kernels;
+}
+
+}  // namespace
+
+void softmax(std::span<float> values, float temperature) {
+  auto& kernels = GetKernels();
+  float max = kernels.max(values.data(), values.size());
+  float sum = kernels.exp_sum(values.data(), values.size(), max, 1.0f / temperature, true);
+  kernels.multiply(values.data(), values.size(), 1.0f / sum);
+}
+
+void log_softmax(std::span<float> values) {
+  auto& kernels = GetKernels();
+  float max = kernels.max(values.data(), values.size());
+  float log_sum = std::log(kernels.exp_sum(values.data(), values.size(), max, 1.0f, false));
+  std::transform(values.begin(), values.end(), values.begin(), [max, log_sum](float v) { return v - max - log_sum; });
 }
 
 }  // namespace Generators
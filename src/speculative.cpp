@@ -0,0 +1,232 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "generators.h"
+#include "models/model.h"
+#include "softmax.h"
+#include "speculative.h"
+
+namespace Generators {
+
+SpeculativeDecoder::SpeculativeDecoder(const GeneratorParams& params)
+    : params_{params.shared_from_this()},
+      draft_model_{params.draft_model} {
+  if (params.device_type != DeviceType::CPU || (draft_model_ && draft_model_->device_type_ != DeviceType::CPU))
+    throw std::runtime_error("Speculative decoding is only supported on the CPU");
+  if (params.BatchBeamSize() != 1)
+    throw std::runtime_error("Speculative decoding is only supported with a batch size of 1 and no beam search");
+  if (params.use_cuda_graph || params.search.past_present_share_buffer)
+    throw std::runtime_error("Speculative decoding is not supported with cuda graphs or past_present_share_buffer");
+  if (!params.row_search.empty())
+    throw std::runtime_error("Speculative decoding is not supported with per row search options");
+  if (params.search.repetition_penalty != 1.0f)
+    throw std::runtime_error("Speculative decoding is not supported with a repetition_penalty");
+  if (params.search.no_repeat_ngram_size != 0)
+    throw std::runtime_error("Speculative decoding is not supported with a no_repeat_ngram_size");
+  if (!params.logits_processors.empty())
+    throw std::runtime_error("Speculative decoding is not supported with logits processors");
+  if (params.search.num_speculative_tokens < 1)
+    throw std::runtime_error("num_speculative_tokens must be 1 or greater, is " + std::to_string(params.search.num_speculative_tokens));
+
+  if (draft_model_) {
+    if (draft_model_->config_->model.vocab_size != params.vocab_size)
+      throw std::runtime_error("The draft model's vocab_size (" + std::to_string(draft_model_->config_->model.vocab_size) + ") must match the model's (" + std::to_string(params.vocab_size) + ")");
+
+    // The draft model runs the same prompt, but none of the target model's extra inputs
+    draft_params_ = std::make_shared<GeneratorParams>(params);
+    draft_params_->draft_model.reset();
+    draft_params_->extra_inputs.clear();
+    draft_params_->external_owner_.reset();
+
+    draft_sequence_lengths_.resize(1);
+    draft_state_ = draft_model_->CreateState(cpu_span<int32_t>{draft_sequence_lengths_.data(), draft_sequence_lengths_.size()}, *draft_params_);
+  } else {
+    if (params.search.prompt_lookup_ngram_size < 1)
+      throw std::runtime_error("Speculative decoding needs a draft model or a prompt_lookup_ngram_size of 1 or greater");
+    ngram_positions_.resize(params.search.prompt_lookup_ngram_size);
+  }
+
+  if (params.search.random_seed != -1)
+    gen_.seed(params.search.random_seed);
+  else
+    gen_.seed(std::random_device{}());
+}
+
+SpeculativeDecoder::~SpeculativeDecoder() = default;
+
+void SpeculativeDecoder::ComputeLogits(State& target, cpu_span<const int32_t> sequence) {
+  const auto& search = params_->search;
+  sequence_length_ = static_cast<int>(sequence.size());
+
+  // The candidates plus the target model's own token must fit in max_length
+  const int count = std::min(search.num_speculative_tokens, search.max_length - sequence_length_ - 1);
+  candidates_.clear();
+  if (draft_state_)
+    ProposeFromDraftModel(sequence, count);
+  else
+    ProposeFromSequence(sequence, count);
+
+  std::vector<int32_t> tokens{sequence.back()};
+  tokens.insert(tokens.end(), candidates_.begin(), candidates_.end());
+  const int current_length = sequence_length_ + static_cast<int>(candidates_.size());
+  target_logits_ = target.RunCandidateTokens(current_length, cpu_span<const int32_t>{tokens.data(), tokens.size()}).GetCPU();
+}
+
+void SpeculativeDecoder::ProposeFromDraftModel(std::span<const int32_t> sequence, int count) {
+  const size_t vocab_size = params_->vocab_size;
+  draft_probs_.resize(count * vocab_size);
+
+  for (int i = 0; i < count; i++) {
+    // The first candidate catches the draft model up with the sequence, starting with the prompt on the first step
+    if (i == 0 && draft_length_ == 0) {
+      draft_state_->Run(params_->sequence_length, cpu_span<int32_t>{}, cpu_span<int32_t>{});
+      draft_length_ = params_->sequence_length;
+    }
+    auto tokens = i == 0 ? sequence.subspan(draft_length_) : std::span<const int32_t>{&candidates_.back(), 1};
+    auto logits = draft_state_->RunAppendedTokens(sequence_length_ + i, cpu_span<const int32_t>{tokens.data(), tokens.size()});
+    draft_length_ = sequence_length_ + i;
+
+    auto probs = std::span<float>{draft_probs_}.subspan(i * vocab_size, vocab_size);
+    copy(std::span<const float>{logits.GetCPU()}, probs);
+    ToProbabilities(probs, sequence_length_ + i);
+    candidates_.push_back(Sample(probs));
+  }
+}
+
+// Prompt lookup: finds the latest earlier occurrence of the sequence's last n tokens, trying the longest n first, and
+// proposes the tokens that followed it. Each n has an index from the hash of every n tokens to where they last ended,
+// extended with the tokens added since the previous step.
+void SpeculativeDecoder::ProposeFromSequence(std::span<const int32_t> sequence, int count) {
+  const int length = static_cast<int>(sequence.size());
+  auto Hash = [&sequence](int end, int n) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (int i = end - n; i < end; i++) {
+      hash ^= static_cast<uint32_t>(sequence[i]);
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  };
+
+  // Index the n-grams that have at least one token after them, so the last n-gram can't match itself
+  for (; indexed_length_ < length - 1; indexed_length_++) {
+    const int end = indexed_length_ + 1;
+    for (int n = 1; n <= static_cast<int>(ngram_positions_.size()) && n <= end; n++)
+      ngram_positions_[n - 1][Hash(end, n)] = end;
+  }
+
+  if (count == 0)
+    return;
+  for (int n = std::min(static_cast<int>(ngram_positions_.size()), length - 1); n > 0; n--) {
+    auto it = ngram_positions_[n - 1].find(Hash(length, n));
+    if (it == ngram_positions_[n - 1].end())
+      continue;
+    const int end = it->second;
+    if (!std::equal(sequence.begin() + end - n, sequence.begin() + end, sequence.end() - n))
+      continue;  // Hash collision
+
+    const int available = std::min(count, length - end);
+    candidates_.assign(sequence.begin() + end, sequence.begin() + end + available);
+    return;
+  }
+}
+
+std::vector<int32_t> SpeculativeDecoder::SelectTokens(State& target) {
+  const size_t vocab_size = params_->vocab_size;
+  std::uniform_real_distribution<float> dis(0, 1);
+
+  std::vector<int32_t> tokens;
+  for (size_t i = 0; i <= candidates_.size(); i++) {
+    auto target_probs = target_logits_.subspan(i * vocab_size, vocab_size);
+    ToProbabilities(target_probs, sequence_length_ + static_cast<int>(i));
+
+    // Every candidate was accepted, so the target model's logits after the last one give an extra token
+    if (i == candidates_.size()) {
+      tokens.push_back(Sample(target_probs));
+      break;
+    }
+
+    // Prompt lookup candidates are certain, so their draft distribution is one hot
+    const int32_t candidate = candidates_[i];
+    auto draft_probs = draft_state_ ? std::span<const float>{draft_probs_}.subspan(i * vocab_size, vocab_size) : std::span<const float>{};
+    const float draft_prob = draft_state_ ? draft_probs[candidate] : 1.0f;
+    if (dis(gen_) * draft_prob < target_probs[candidate]) {
+      tokens.push_back(candidate);
+      continue;
+    }
+
+    // Rejected, so pick from where the target model has more probability than the draft
+    if (draft_state_) {
+      for (size_t j = 0; j < vocab_size; j++)
+        target_probs[j] = std::max(0.0f, target_probs[j] - draft_probs[j]);
+    } else
+      target_probs[candidate] = 0.0f;
+    tokens.push_back(Sample(target_probs));
+    break;
+  }
+
+  // The KV caches keep the accepted candidates, the last token is run by the next step
+  const int kv_length = sequence_length_ + static_cast<int>(tokens.size()) - 1;
+  if (tokens.size() <= candidates_.size())
+    target.Rewind(kv_length);
+  if (draft_state_ && draft_length_ > kv_length) {
+    draft_state_->Rewind(kv_length);
+    draft_length_ = kv_length;
+  }
+  return tokens;
+}
+
+// Turns logits into the distribution the search would pick the next token from. Without do_sample that's one hot on the
+// top token, otherwise it's the softmax at the temperature limited to the top_k tokens and then to the top_p nucleus.
+void SpeculativeDecoder::ToProbabilities(std::span<float> logits, int sequence_length) {
+  const auto& search = params_->search;
+  if (sequence_length < search.min_length)
+    logits[params_->eos_token_id] = std::numeric_limits<float>::lowest();
+
+  if (!search.do_sample || search.top_k == 1) {
+    auto top = std::max_element(logits.begin(), logits.end()) - logits.begin();
+    std::fill(logits.begin(), logits.end(), 0.0f);
+    logits[top] = 1.0f;
+    return;
+  }
+
+  softmax(logits, search.temperature);
+  const bool use_top_p = search.top_p > 0.0f && search.top_p < 1.0f;
+  if (search.top_k <= 1 && !use_top_p)
+    return;
+
+  size_t keep = search.top_k > 1 ? std::min(static_cast<size_t>(search.top_k), logits.size()) : logits.size();
+  indices_.resize(logits.size());
+  std::iota(indices_.begin(), indices_.end(), 0);
+  std::partial_sort(indices_.begin(), indices_.begin() + keep, indices_.end(), [&logits](int32_t i, int32_t j) { return logits[i] > logits[j]; });
+
+  float total = 0.0f;
+  for (size_t i = 0; i < keep; i++) {
+    total += logits[indices_[i]];
+    if (use_top_p && total >= search.top_p) {
+      keep = i + 1;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < keep; i++)
+    logits[indices_[i]] /= total;
+  for (size_t i = keep; i < indices_.size(); i++)
+    logits[indices_[i]] = 0.0f;
+}
+
+int32_t SpeculativeDecoder::Sample(std::span<const float> weights) {
+  const float total = std::accumulate(weights.begin(), weights.end(), 0.0f);
+  float threshold = std::uniform_real_distribution<float>(0, total)(gen_);
+
+  int32_t token = 0;
+  for (size_t i = 0; i < weights.size(); i++) {
+    if (weights[i] == 0.0f)
+      continue;
+    token = static_cast<int32_t>(i);  // The last token with any weight, in case rounding leaves some threshold
+    threshold -= weights[i];
+    if (threshold < 0.0f)
+      break;
+  }
+  return token;
+}
+
+}  // namespace Generators
@@ -0,0 +1,53 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <random>
+
+namespace Generators {
+
+// Speculative decoding: up to num_speculative_tokens candidate tokens are proposed, either one at a time by a small draft
+// model or by prompt lookup (copying what followed an earlier occurrence of the last few tokens), then the target model
+// runs them all at once. Each candidate is accepted by rejection sampling, kept with probability min(1, p/q) for target
+// & draft probabilities p & q, or else replaced by a sample of max(0, p - q) which ends the step. This keeps the output
+// distributed as if the target model alone generated it, while running it once per several tokens. Prompt lookup
+// candidates have a one hot q, and without do_sample so does p, so a candidate is accepted when it's the target's top token.
+//
+// Only a batch size of 1 without beam search on the CPU is supported, and a draft model must share the vocabulary.
+struct SpeculativeDecoder {
+  SpeculativeDecoder(const GeneratorParams& params);  // Uses params.draft_model if set, otherwise prompt lookup
+  ~SpeculativeDecoder();
+
+  // Proposes candidates to follow sequence, then runs them through target along with the last token
+  // of sequence (the one target hasn't run yet)
+  void ComputeLogits(State& target, cpu_span<const int32_t> sequence);
+
+  // Returns the tokens to add to the sequence, the accepted candidates followed by one chosen by the target model, and
+  // drops the rejected candidates from both models' KV caches
+  std::vector<int32_t> SelectTokens(State& target);
+
+ private:
+  void ProposeFromDraftModel(std::span<const int32_t> sequence, int count);
+  void ProposeFromSequence(std::span<const int32_t> sequence, int count);
+  void ToProbabilities(std::span<float> logits, int sequence_length);
+  int32_t Sample(std::span<const float> weights);
+
+  std::shared_ptr<const GeneratorParams> params_;
+  std::shared_ptr<const Model> draft_model_;
+  std::shared_ptr<GeneratorParams> draft_params_;
+  std::vector<int32_t> draft_sequence_lengths_;
+  std::unique_ptr<State> draft_state_;
+  int draft_length_{};  // Tokens held in the draft model's KV cache
+
+  std::vector<std::unordered_map<uint64_t, int>> ngram_positions_;  // [n - 1] is hash of n tokens -> latest end of them
+  int indexed_length_{};                                          // Sequence tokens whose n-grams have been indexed
+
+  int sequence_length_{};  // Length of the sequence given to ComputeLogits
+  std::vector<int32_t> candidates_;
+  std::vector<float> draft_probs_;  // [candidates, vocab_size], only for a draft model
+  cpu_span<float> target_logits_;   // [candidates + 1, vocab_size]
+  std::vector<int32_t> indices_;    // Scratch space for ToProbabilities
+
+  std::mt19937 gen_;
+};
+
+}  // namespace Generators
@@ -0,0 +1,130 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "generators.h"
+#include "worker_pool.h"
+#include <atomic>
+
+namespace Generators {
+
+WorkerPool::WorkerPool(size_t thread_count) {
+  for (size_t i = 0; i < thread_count; i++)
+    threads_.emplace_back([this] { Work(); });
+}
+
+WorkerPool::~WorkerPool() {
+  Stop();
+}
+
+void WorkerPool::Stop() {
+  {
+    std::scoped_lock lock{mutex_};
+    stopping_ = true;
+  }
+  job_ready_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+  threads_.clear();
+}
+
+void WorkerPool::Submit(std::function<void()> job) {
+  {
+    std::scoped_lock lock{mutex_};
+    jobs_.push_back(std::move(job));
+  }
+  job_ready_.notify_one();
+}
+
+void WorkerPool::Work() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock lock{mutex_};
+      job_ready_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+      if (jobs_.empty())
+        return;  // Only possible when stopping
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    // Jobs report their own errors, anything that still escapes mustn't take the thread (and the process) down
+    try {
+      job();
+    } catch (const std::exception& e) {
+      if (g_log.enabled && g_log.warning)
+        Log("warning", std::string{"Worker pool job failed: "} + e.what());
+    } catch (...) {
+      if (g_log.enabled && g_log.warning)
+        Log("warning", "Worker pool job failed with an unknown error");
+    }
+  }
+}
+
+WorkerPool& GetWorkerPool() {
+  auto& globals = *GetOrtGlobals();
+  std::call_once(globals.worker_pool_created_, [&globals] {
+    globals.worker_pool_ = std::make_unique<WorkerPool>(std::max(std::thread::hardware_concurrency(), 1U));
+  });
+  return *globals.worker_pool_;
+}
+
+namespace {
+
+struct ParallelForState {
+  ParallelForState(size_t count) : count_{count} {}
+
+  // Runs indices until none are left. Jobs that start after that do nothing, so never touch the caller's fn
+  void Run(const std::function<void(size_t)>& fn) {
+    while (true) {
+      const size_t i = next_++;
+      if (i >= count_)
+        return;
+      try {
+        fn(i);
+      } catch (...) {
+        std::scoped_lock lock{mutex_};
+        if (!error_)
+          error_ = std::current_exception();
+      }
+      if (++finished_ == count_) {
+        std::scoped_lock lock{mutex_};
+        all_finished_.notify_all();
+      }
+    }
+  }
+
+  void Wait() {
+    std::unique_lock lock{mutex_};
+    all_finished_.wait(lock, [this] { return finished_ == count_; });
+    if (error_)
+      std::rethrow_exception(error_);
+  }
+
+ private:
+  const size_t count_;
+  std::atomic<size_t> next_{};
+  std::atomic<size_t> finished_{};
+  std::mutex mutex_;
+  std::condition_variable all_finished_;
+  std::exception_ptr error_;
+};
+
+}  // namespace
+
+void ParallelFor(size_t count, size_t thread_count, const std::function<void(size_t)>& fn) {
+  if (thread_count == 0)
+    thread_count = std::max(std::thread::hardware_concurrency(), 1U);
+  thread_count = std::min(thread_count, count);
+  if (thread_count <= 1) {
+    for (size_t i = 0; i < count; i++)
+      fn(i);
+    return;
+  }
+
+  auto state = std::make_shared<ParallelForState>(count);
+  auto& pool = GetWorkerPool();
+  for (size_t i = 1; i < thread_count; i++)
+    pool.Submit([state, &fn] { state->Run(fn); });
+  state->Run(fn);
+  state->Wait();
+}
+
+}  // namespace Generators
@@ -0,0 +1,38 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace Generators {
+
+// A fixed set of threads running submitted jobs in order. Destroying the pool runs every job still queued, including
+// ones submitted by running jobs, before the threads exit.
+struct WorkerPool {
+  WorkerPool(size_t thread_count);
+  ~WorkerPool();
+
+  void Submit(std::function<void()> job);
+  void Stop();  // Runs every queued job, as the destructor does, while the pool is still reachable through GetWorkerPool()
+
+ private:
+  void Work();
+
+  std::mutex mutex_;
+  std::condition_variable job_ready_;
+  std::deque<std::function<void()>> jobs_;
+  bool stopping_{};
+  std::vector<std::thread> threads_;
+};
+
+WorkerPool& GetWorkerPool();  // The pool shared by the whole library, created on first use with one thread per core
+
+// Calls fn(0) through fn(count - 1) on up to thread_count threads (0 means one per core), the caller being one of them,
+// and returns once all are done. The caller takes whatever indices the pool's threads haven't, so it's safe to use from
+// a job already running on the pool. The first exception thrown by fn is rethrown.
+void ParallelFor(size_t count, size_t thread_count, const std::function<void(size_t)>& fn);
+
+}  // namespace Generators
@@ -2,7 +2,11 @@
 #include <generators.h>
 #include <search.h>
 #include <models/model.h>
+#include <chrono>
+#include <cstdlib>
+#include <future>
 #include <iostream>
+#include <thread>
 #include <ort_genai.h>
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
@@ -172,6 +176,269 @@ TEST(CAPITests, GreedySearchGptFp32CAPI) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence_data, sequence_length * sizeof(int32_t)));
   }
 }
+
+struct BanTokensProcessor {
+  std::vector<int32_t> banned;
+  int call_count{};
+};
+
+void OGA_API_CALL BanTokens(int32_t /*row*/, const int32_t* /*sequence*/, size_t /*sequence_length*/, float* logits, size_t /*vocab_size*/, void* user_data) {
+  auto& processor = *reinterpret_cast<BanTokensProcessor*>(user_data);
+  processor.call_count++;
+  for (auto token : processor.banned)
+    logits[token] = std::numeric_limits<float>::lowest();
+}
+
+// Same inputs as GreedySearchGptFp32CAPI, but the tokens it repeats are banned by a logits processor
+TEST(CAPITests, LogitsProcessorGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  const int max_length = 10;
+  const int batch_size = 2;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, batch_size);
+  BanTokensProcessor processor{{204, 731, 114}};
+  params->AddLogitsProcessor(BanTokens, &processor);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+  }
+
+  EXPECT_EQ(processor.call_count, batch_size * (max_length - 4));
+  for (int i = 0; i < batch_size; i++) {
+    const auto* sequence_data = generator->GetSequenceData(i);
+    for (size_t j = 4; j < generator->GetSequenceCount(i); j++)
+      EXPECT_EQ(std::find(processor.banned.begin(), processor.banned.end(), sequence_data[j]), processor.banned.end());
+  }
+}
+
+// Appending tokens to a generator must give the same result as starting over from the combined sequence
+TEST(CAPITests, AppendTokensGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> appended_ids{195, 731};
+  int max_length = 20;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size(), 1);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  for (int i = 0; i < 3; i++) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+  }
+  generator->AppendTokens(appended_ids.data(), appended_ids.size());
+
+  auto prompt = generator->GetSequence(0);
+  std::vector<int32_t> combined_ids(prompt.begin(), prompt.end());
+  ASSERT_EQ(combined_ids.size(), input_ids.size() + 3 + appended_ids.size());
+
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+  }
+
+  auto combined_params = OgaGeneratorParams::Create(*model);
+  combined_params->SetSearchOption("max_length", max_length);
+  combined_params->SetInputIDs(combined_ids.data(), combined_ids.size(), combined_ids.size(), 1);
+  auto expected = model->Generate(*combined_params);
+
+  auto sequence = generator->GetSequence(0);
+  ASSERT_EQ(sequence.size(), expected->SequenceCount(0));
+  EXPECT_TRUE(0 == std::memcmp(expected->SequenceData(0), sequence.data(), sequence.size() * sizeof(int32_t)));
+}
+
+// Several generators sharing one model, each on its own thread, must produce the same results as when run alone
+TEST(CAPITests, ConcurrentGeneratorsGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  const int max_length = 10;
+  const int thread_count = 8;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  std::vector<std::vector<int32_t>> outputs(thread_count);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.emplace_back([&, t] {
+      // Alternate between the two prompts so concurrent generators differ
+      const int prompt = t % 2;
+      auto params = OgaGeneratorParams::Create(*model);
+      params->SetSearchOption("max_length", max_length);
+      params->SetInputIDs(input_ids.data() + prompt * 4, 4, 4, 1);
+
+      auto generator = OgaGenerator::Create(*model, *params);
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+      auto sequence = generator->GetSequence(0);
+      outputs[t].assign(sequence.begin(), sequence.end());
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  for (int t = 0; t < thread_count; t++) {
+    const auto* expected_output_start = &expected_output[(t % 2) * max_length];
+    ASSERT_EQ(outputs[t].size(), static_cast<size_t>(max_length));
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start, outputs[t].data(), max_length * sizeof(int32_t)));
+  }
+}
+
+struct AsyncGenerationResult {
+  std::vector<int32_t> tokens;  // Every token passed to on_token, in order
+  std::vector<std::vector<int32_t>> sequences;
+  std::string error;
+  int token_callback_count{};
+  bool pause_on_first_token{};
+  std::promise<void> first_token, resume;
+  std::promise<void> done;
+};
+
+void OGA_API_CALL OnAsyncToken(const int32_t* tokens, size_t token_count, void* user_data) {
+  auto& result = *static_cast<AsyncGenerationResult*>(user_data);
+  result.tokens.insert(result.tokens.end(), tokens, tokens + token_count);
+  if (result.token_callback_count++ == 0 && result.pause_on_first_token) {
+    result.first_token.set_value();
+    result.resume.get_future().wait();
+  }
+}
+
+void OGA_API_CALL OnAsyncDone(const OgaSequences* sequences, const OgaResult* error, void* user_data) {
+  auto& result = *static_cast<AsyncGenerationResult*>(user_data);
+  if (error)
+    result.error = OgaResultGetError(error);
+  for (size_t i = 0; i < sequences->Count(); i++) {
+    auto sequence = sequences->Get(i);
+    result.sequences.emplace_back(sequence.begin(), sequence.end());
+  }
+  result.done.set_value();
+}
+
+TEST(CAPITests, GenerateAsyncGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  const int max_length = 10;
+  const int generation_count = 4;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // Start every generation before waiting on any of them, so their steps interleave on the worker pool
+  std::vector<AsyncGenerationResult> results(generation_count);
+  std::vector<std::unique_ptr<OgaAsyncGenerator>> generators;
+  for (int i = 0; i < generation_count; i++) {
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", max_length);
+    params->SetInputIDs(input_ids.data() + (i % 2) * 4, 4, 4, 1);
+    generators.push_back(OgaAsyncGenerator::Create(*model, *params, OnAsyncToken, OnAsyncDone, &results[i]));
+  }
+
+  for (int i = 0; i < generation_count; i++) {
+    auto& result = results[i];
+    result.done.get_future().wait();
+    EXPECT_TRUE(result.error.empty());
+    EXPECT_EQ(result.token_callback_count, max_length - 4);
+    ASSERT_EQ(result.sequences.size(), static_cast<size_t>(1));
+    ASSERT_EQ(result.sequences[0].size(), static_cast<size_t>(max_length));
+    EXPECT_TRUE(0 == std::memcmp(&expected_output[(i % 2) * max_length], result.sequences[0].data(), max_length * sizeof(int32_t)));
+  }
+}
+
+// With speculative decoding a step can add several tokens, and the token callbacks must still see every one of them
+TEST(CAPITests, GenerateAsyncSpeculativeGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> expected_output{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  const int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetSearchOption("num_speculative_tokens", 3);
+  params->SetSearchOption("prompt_lookup_ngram_size", 1);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size(), 1);
+
+  AsyncGenerationResult result;
+  auto generator = OgaAsyncGenerator::Create(*model, *params, OnAsyncToken, OnAsyncDone, &result);
+  result.done.get_future().wait();
+
+  EXPECT_TRUE(result.error.empty());
+  EXPECT_LT(result.token_callback_count, max_length - 4);  // The repeated 204s get accepted several at a time
+  EXPECT_EQ(result.tokens, std::vector<int32_t>(expected_output.begin() + 4, expected_output.end()));
+  ASSERT_EQ(result.sequences.size(), static_cast<size_t>(1));
+  EXPECT_EQ(result.sequences[0], expected_output);
+}
+
+TEST(CAPITests, GenerateAsyncCancelGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size(), 1);
+
+  AsyncGenerationResult result;
+  result.pause_on_first_token = true;
+  auto generator = OgaAsyncGenerator::Create(*model, *params, OnAsyncToken, OnAsyncDone, &result);
+
+  // Cancel while the first step's token callback is running, so no further steps get run
+  result.first_token.get_future().wait();
+  generator->Cancel();
+  result.resume.set_value();
+
+  result.done.get_future().wait();
+  EXPECT_TRUE(result.error.empty());
+  EXPECT_EQ(result.token_callback_count, 1);
+  ASSERT_EQ(result.sequences.size(), static_cast<size_t>(1));
+  EXPECT_EQ(result.sequences[0].size(), static_cast<size_t>(5));
+}
+
+// Returns the exit code for the death test below, 0 when the generation ran to the end across the shutdown
+int ShutdownDuringGenerateAsync() {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size(), 1);
+
+  AsyncGenerationResult result;
+  result.pause_on_first_token = true;
+  auto generator = OgaAsyncGenerator::Create(*model, *params, OnAsyncToken, OnAsyncDone, &result);
+
+  // Shut down while the generation is in its first step, the remaining steps must still run
+  result.first_token.get_future().wait();
+  std::thread resume{[&result] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    result.resume.set_value();
+  }};
+  OgaShutdown();
+  resume.join();
+
+  bool finished = result.done.get_future().wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  return finished && result.error.empty() && result.token_callback_count == 6 ? 0 : 1;
+}
+
+TEST(CAPIDeathTest, ShutdownDuringGenerateAsyncGptFp32CAPI) {
+  // Shutdown can't be undone, so it runs in its own process. The model & generator are never freed, as the process
+  // exits right away.
+  GTEST_FLAG_SET(death_test_style, "threadsafe");
+  EXPECT_EXIT(std::_Exit(ShutdownDuringGenerateAsync()), ::testing::ExitedWithCode(0), "");
+}
 #endif
 
 #if TEST_PHI2
@@ -5,7 +5,12 @@
 #include <generators.h>
 #include <search.h>
 #include <models/model.h>
+#include <models/continuous_batch.h>
+#include <models/kv_cache.h>
+#include <models/paged_kv_cache.h>
+#include <logits_processor.h>
 #include <iostream>
+#include <numeric>
 #include <random>
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
@@ -56,6 +61,517 @@ TEST(ModelTests, GreedySearchGptFp32) {
   }
 }
 
+// Same as GreedySearchGptFp32, but the prompt is run in chunks that extend the KV cache before the final chunk
+// produces the logits, which must not change the output
+TEST(ModelTests, ChunkedPrefillGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  for (int chunk_size : {1, 2, 3}) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->search.prefill_chunk_size = chunk_size;
+    params->batch_size = 2;
+    params->sequence_length = 4;
+    params->input_ids = input_ids;
+
+    auto generator = Generators::CreateGenerator(*model, *params);
+
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+
+    for (size_t i = 0; i < static_cast<size_t>(params->batch_size); i++) {
+      auto sequence = generator->GetSequence(i).GetCPU();
+      auto* expected_output_start = &expected_output[i * params->search.max_length];
+      EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
+    }
+  }
+}
+
+// Same inputs as GreedySearchGptFp32 one sequence at a time, with speculative decoding from a draft model. With the
+// model as its own draft every candidate gets accepted, and greedy speculative decoding must not change the output
+TEST(ModelTests, SpeculativeDecodingGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto draft_model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                             MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  for (int speculative_tokens : {1, 3, 8}) {
+    for (size_t i = 0; i < 2; i++) {
+      auto params = Generators::CreateGeneratorParams(*model);
+      params->search.max_length = 10;
+      params->search.num_speculative_tokens = speculative_tokens;
+      params->draft_model = draft_model;
+      params->batch_size = 1;
+      params->sequence_length = 4;
+      params->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+
+      auto generator = Generators::CreateGenerator(*model, *params);
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+
+      auto sequence = generator->GetSequence(0).GetCPU();
+      ASSERT_EQ(sequence.size(), static_cast<size_t>(params->search.max_length));
+      EXPECT_TRUE(0 == std::memcmp(&expected_output[i * params->search.max_length], sequence.data(), params->search.max_length * sizeof(int32_t)));
+    }
+  }
+
+  // When sampling the tokens are random, but generation must still stop at exactly max_length
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->search.do_sample = true;
+  params->search.top_k = 5;
+  params->search.random_seed = 42;
+  params->draft_model = draft_model;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->input_ids = std::span<const int32_t>(input_ids).subspan(0, 4);
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+  }
+  EXPECT_EQ(generator->GetSequence(0).GetCPU().size(), static_cast<size_t>(params->search.max_length));
+}
+
+// Runs the real model, but on every other position bans the token it would pick, so the target model rejects that
+// candidate and the draft has to be rewound
+struct DisagreeingDraftModel : Generators::Model {
+  struct DraftState : Generators::State {
+    DraftState(std::unique_ptr<Generators::State> state, const Generators::GeneratorParams& params, int& rewind_count)
+        : State{params}, state_{std::move(state)}, rewind_count_{rewind_count} {}
+
+    Generators::RoamingArray<float> Run(int current_length, Generators::RoamingArray<int32_t> next_tokens, Generators::RoamingArray<int32_t> next_indices) override {
+      return state_->Run(current_length, next_tokens, next_indices);
+    }
+
+    Generators::RoamingArray<float> RunAppendedTokens(int current_length, Generators::cpu_span<const int32_t> tokens) override {
+      auto logits = state_->RunAppendedTokens(current_length, tokens);
+      if (current_length % 2 == 0) {
+        auto scores = logits.GetCPU();
+        *std::max_element(scores.begin(), scores.end()) = std::numeric_limits<float>::lowest();
+      }
+      return logits;
+    }
+
+    void Rewind(int length) override {
+      rewind_count_++;
+      state_->Rewind(length);
+    }
+
+    std::unique_ptr<Generators::State> state_;
+    int& rewind_count_;
+  };
+
+  DisagreeingDraftModel(std::shared_ptr<Generators::Model> model)
+      : Model{std::make_unique<Generators::Config>(*model->config_)}, model_{std::move(model)} {}
+
+  std::unique_ptr<Generators::State> CreateState(Generators::RoamingArray<int32_t> sequence_lengths, const Generators::GeneratorParams& params) const override {
+    return std::make_unique<DraftState>(model_->CreateState(sequence_lengths, params), params, rewind_count_);
+  }
+
+  std::shared_ptr<Generators::Model> model_;
+  mutable int rewind_count_{};
+};
+
+// Same as SpeculativeDecodingGptFp32, but half the draft model's candidates are wrong. The target model's token replaces
+// each rejected one, so the greedy output still matches GreedySearchGptFp32
+TEST(ModelTests, SpeculativeDecodingRejectionGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto draft_model = std::make_shared<DisagreeingDraftModel>(
+      Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+
+  // At least 3 candidates, so a rejection always leaves the draft model ahead of the kept tokens
+  for (int speculative_tokens : {3, 5}) {
+    for (size_t i = 0; i < 2; i++) {
+      auto params = Generators::CreateGeneratorParams(*model);
+      params->search.max_length = 10;
+      params->search.num_speculative_tokens = speculative_tokens;
+      params->draft_model = draft_model;
+      params->batch_size = 1;
+      params->sequence_length = 4;
+      params->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+
+      draft_model->rewind_count_ = 0;
+      auto generator = Generators::CreateGenerator(*model, *params);
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+      EXPECT_GT(draft_model->rewind_count_, 0);
+
+      auto sequence = generator->GetSequence(0).GetCPU();
+      ASSERT_EQ(sequence.size(), static_cast<size_t>(params->search.max_length));
+      EXPECT_TRUE(0 == std::memcmp(&expected_output[i * params->search.max_length], sequence.data(), params->search.max_length * sizeof(int32_t)));
+    }
+  }
+}
+
+// Same as SpeculativeDecodingGptFp32, but the candidates come from earlier in the sequence instead of a draft model.
+// The repeated tokens get accepted, while the second prompt's repeat of 731 gets rejected in favor of 114
+TEST(ModelTests, PromptLookupDecodingGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  for (int ngram_size : {1, 2, 3}) {
+    for (size_t i = 0; i < 2; i++) {
+      auto params = Generators::CreateGeneratorParams(*model);
+      params->search.max_length = 10;
+      params->search.num_speculative_tokens = 3;
+      params->search.prompt_lookup_ngram_size = ngram_size;
+      params->batch_size = 1;
+      params->sequence_length = 4;
+      params->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+
+      auto generator = Generators::CreateGenerator(*model, *params);
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+
+      auto sequence = generator->GetSequence(0).GetCPU();
+      ASSERT_EQ(sequence.size(), static_cast<size_t>(params->search.max_length));
+      EXPECT_TRUE(0 == std::memcmp(&expected_output[i * params->search.max_length], sequence.data(), params->search.max_length * sizeof(int32_t)));
+    }
+  }
+}
+
+// The speculative steps skip the logits processing, so a generator with logits processors must refuse to speculate
+TEST(ModelTests, SpeculativeDecodingLogitsProcessorGptFp32) {
+  struct NoOpProcessor : Generators::LogitsProcessor {
+    void Process(int /*row*/, std::span<const int32_t> /*sequence*/, std::span<float> /*scores*/) override {}
+  };
+
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->search.prompt_lookup_ngram_size = 2;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+  params->logits_processors.push_back(std::make_shared<NoOpProcessor>());
+
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+// Same as GreedySearchGptFp32, but the second row has a shorter max_length of its own, so it's padded after that
+TEST(ModelTests, PerRowMaxLengthGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 98, 98, 98};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+  params->row_search.resize(2, params->search);
+  params->row_search[1].max_length = 7;
+
+  auto result = Generators::Generate(*model, *params);
+
+  for (size_t i = 0; i < static_cast<size_t>(params->batch_size); i++) {
+    ASSERT_EQ(result[i].size(), static_cast<size_t>(params->search.max_length));
+    EXPECT_TRUE(0 == std::memcmp(&expected_output[i * params->search.max_length], result[i].data(), params->search.max_length * sizeof(int32_t)));
+  }
+
+  // A row can't end before its prompt does
+  params->row_search[1].max_length = params->sequence_length;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+// The tiny model repeats itself a lot, so without no_repeat_ngram_size these outputs are full of repeated bigrams
+TEST(ModelTests, NoRepeatNgramGptFp32) {
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+  const int ngram_size = 2;
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  for (int num_beams : {1, 4}) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->batch_size = 3;
+    params->sequence_length = 12;
+    params->input_ids = input_ids;
+    params->search.max_length = 20;
+    params->search.num_beams = num_beams;
+    params->search.no_repeat_ngram_size = ngram_size;
+
+    auto generator = Generators::CreateGenerator(*model, *params);
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+
+    // No generated token, up to an EOS, completes an n-gram that's already in its sequence
+    for (int row = 0; row < params->BatchBeamSize(); row++) {
+      auto sequence = generator->search_->GetSequence(row).GetCPU();
+      for (size_t end = params->sequence_length; end < sequence.size() && sequence[end - 1] != params->eos_token_id; end++) {
+        auto ngram = sequence.subspan(end + 1 - ngram_size, ngram_size);
+        for (size_t start = 0; start + ngram_size <= end; start++)
+          EXPECT_FALSE(std::equal(ngram.begin(), ngram.end(), sequence.begin() + start)) << "num_beams " << num_beams << " row " << row << " position " << end;
+      }
+    }
+  }
+
+  // The speculative steps skip the logits processing that bans the n-grams, so speculating with it is refused
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 1;
+  params->sequence_length = 12;
+  params->input_ids = std::span<const int32_t>(input_ids).first(12);
+  params->search.max_length = 20;
+  params->search.no_repeat_ngram_size = ngram_size;
+  params->search.prompt_lookup_ngram_size = 2;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+// Same inputs as GreedySearchGptFp32, but the second sequence joins the running batch after the first one has
+// already generated a few tokens, so the batched decode runs over sequences of different lengths
+TEST(ModelTests, ContinuousBatchGptFp32) {
+  std::vector<int32_t> input_ids0{0, 0, 0, 52};
+  std::vector<int32_t> input_ids1{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto CreateParams = [&](std::span<const int32_t> input_ids) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->batch_size = 1;
+    params->sequence_length = static_cast<int>(input_ids.size());
+    params->input_ids = input_ids;
+    return params;
+  };
+
+  auto params0 = CreateParams(input_ids0);
+  auto params1 = CreateParams(input_ids1);
+
+  Generators::ContinuousBatch batch{*model};
+  int request0 = batch.AddRequest(*params0);
+  batch.Step();
+  batch.Step();
+
+  int request1 = batch.AddRequest(*params1);
+  EXPECT_EQ(batch.GetLiveRequestCount(), 2);
+
+  while (batch.GetLiveRequestCount() != 0)
+    batch.Step();
+
+  auto sequence0 = batch.GetSequence(request0).GetCPU();
+  auto sequence1 = batch.GetSequence(request1).GetCPU();
+  ASSERT_EQ(sequence0.size(), expected_output0.size());
+  ASSERT_EQ(sequence1.size(), expected_output1.size());
+  EXPECT_TRUE(0 == std::memcmp(expected_output0.data(), sequence0.data(), expected_output0.size() * sizeof(int32_t)));
+  EXPECT_TRUE(0 == std::memcmp(expected_output1.data(), sequence1.data(), expected_output1.size() * sizeof(int32_t)));
+
+  batch.RemoveRequest(request0);
+  EXPECT_EQ(batch.GetRequestCount(), 1);
+  batch.RemoveRequest(request1);
+  EXPECT_EQ(batch.GetFreeKVBlockCount(), 1024);
+}
+
+// ReorderBeams moves beams around in place, so check it against a plain gather on swaps, cycles and beams continued
+// more than once. One group is the layout of KV_Cache's separate key & value tensors, two that of KV_Cache_Combined.
+TEST(ModelTests, KVBuffersReorderBeams) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  const std::vector<std::vector<int32_t>> permutations{{1, 0, 3, 2}, {0, 0, 1, 2}, {2, 0, 1, 3}, {3, 3, 3, 3}, {0, 1, 2, 3}};
+  const int64_t beam_count = 4, block_size = 6;
+
+  for (int64_t group_count : {1, 2}) {
+    std::vector<int64_t> shape{group_count, beam_count, 2, block_size / 2};
+    std::vector<float> values(group_count * beam_count * block_size);
+    std::iota(values.begin(), values.end(), 0.0f);
+    auto tensor = OrtValue::CreateTensor<float>(model->allocator_cpu_.GetInfo(), std::span<float>{values}, shape);
+
+    // The same buffers for every reorder, so the scratch buffer gets reused
+    Generators::KV_Buffers buffers{*model, 1, values.size() * sizeof(float)};
+    for (auto& beam_indices : permutations) {
+      std::vector<float> expected(values.size());
+      for (int64_t group = 0; group < group_count; group++) {
+        for (int64_t beam = 0; beam < beam_count; beam++) {
+          auto source = values.begin() + (group * beam_count + beam_indices[beam]) * block_size;
+          std::copy(source, source + block_size, expected.begin() + (group * beam_count + beam) * block_size);
+        }
+      }
+
+      buffers.ReorderBeams(*tensor, beam_indices, group_count);
+      EXPECT_EQ(values, expected) << "group_count " << group_count << " beam_indices " << beam_indices[0] << beam_indices[1] << beam_indices[2] << beam_indices[3];
+    }
+  }
+}
+
+TEST(ModelTests, PagedKVCache) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // Combined key/value layout like the gpt2 model, 3 blocks of 4 tokens
+  std::array<int64_t, 5> kv_shape{2, 0, 2, 0, 3};
+  Generators::PagedKV_Cache kv_cache{*model, 1, kv_shape, 1, Ort::TypeToTensorType<float>::type, 3, 4};
+
+  // A present of batch size 2 holding 6 tokens, take the second batch entry
+  std::array<int64_t, 5> present_shape{2, 2, 2, 6, 3};
+  auto present = OrtValue::CreateTensor<float>(model->allocator_cpu_, present_shape);
+  auto present_data = std::span<float>(present->GetTensorMutableData<float>(), 2 * 2 * 2 * 6 * 3);
+  std::iota(present_data.begin(), present_data.end(), 0.0f);
+
+  Generators::KV_BlockTable table;
+  kv_cache.Reserve(table, 6);
+  EXPECT_EQ(table.blocks.size(), 2);
+  EXPECT_EQ(kv_cache.GetFreeBlockCount(), 1);
+  kv_cache.Write(table, 0, *present, 1, 0, 6);
+  table.length = 6;
+
+  // Gather into a past of length 8, right aligned like a left padded batch entry, the padding is zeroed
+  std::array<int64_t, 5> past_shape{2, 1, 2, 8, 3};
+  auto past = OrtValue::CreateTensor<float>(model->allocator_cpu_, past_shape);
+  auto past_data = std::span<float>(past->GetTensorMutableData<float>(), 2 * 1 * 2 * 8 * 3);
+  std::fill(past_data.begin(), past_data.end(), -1.0f);
+  kv_cache.Gather(table, 0, *past, 0, 2);
+
+  for (int outer = 0; outer < 2; outer++) {
+    for (int head = 0; head < 2; head++) {
+      for (int token = 0; token < 8; token++) {
+        for (int i = 0; i < 3; i++) {
+          float value = past_data[((outer * 2 + head) * 8 + token) * 3 + i];
+          if (token < 2)
+            EXPECT_EQ(value, 0.0f);
+          else
+            EXPECT_EQ(value, present_data[(((outer * 2 + 1) * 2 + head) * 6 + token - 2) * 3 + i]);
+        }
+      }
+    }
+  }
+
+  Generators::KV_BlockTable other;
+  EXPECT_THROW(kv_cache.Reserve(other, 8), std::runtime_error);
+
+  kv_cache.Release(table);
+  kv_cache.Release(other);
+  EXPECT_EQ(kv_cache.GetFreeBlockCount(), 3);
+}
+
+TEST(ModelTests, PrefixCacheGptFp32) {
+  std::vector<int32_t> input_ids0{0, 0, 195, 731};
+  std::vector<int32_t> input_ids1{0, 0, 0, 52};
+
+  std::vector<int32_t> expected_output0{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+  std::vector<int32_t> expected_output1{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  model->prefix_cache_ = std::make_unique<Generators::PrefixCache>(1 << 20, 2);
+
+  auto Generate = [&](std::span<const int32_t> input_ids) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->batch_size = 1;
+    params->sequence_length = static_cast<int>(input_ids.size());
+    params->input_ids = input_ids;
+    return Generators::Generate(*model, *params)[0];
+  };
+
+  // The first run fills the cache, the second reuses the first 2 tokens, the third shares only the first block
+  EXPECT_EQ(Generate(input_ids0), expected_output0);
+  EXPECT_EQ(model->prefix_cache_->GetEntryCount(), 1);
+  EXPECT_EQ(Generate(input_ids0), expected_output0);
+  EXPECT_EQ(model->prefix_cache_->GetEntryCount(), 1);
+  EXPECT_EQ(Generate(input_ids1), expected_output1);
+  EXPECT_EQ(model->prefix_cache_->GetEntryCount(), 2);
+
+  // With room for a single prompt the older one is evicted
+  size_t entry_bytes = model->prefix_cache_->GetByteCount() / 2;
+  model->prefix_cache_ = std::make_unique<Generators::PrefixCache>(entry_bytes, 2);
+  EXPECT_EQ(Generate(input_ids0), expected_output0);
+  EXPECT_EQ(Generate(input_ids1), expected_output1);
+  EXPECT_EQ(model->prefix_cache_->GetEntryCount(), 1);
+  EXPECT_EQ(model->prefix_cache_->GetByteCount(), entry_bytes);
+}
+
+TEST(ModelTests, PrefixCacheSharedPrefixes) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // A single [1, 1, sequence, 1] float KV, so 8 bytes per cached token counting the token itself
+  auto Insert = [&](Generators::PrefixCache& cache, std::vector<int32_t> tokens) {
+    std::vector<int64_t> shape{1, 1, static_cast<int64_t>(tokens.size()), 1};
+    std::vector<std::unique_ptr<OrtValue>> presents;
+    presents.push_back(OrtValue::CreateTensor<float>(model->allocator_cpu_, shape));
+    cache.Insert(tokens, presents, model->allocator_cpu_);
+  };
+  auto Lookup = [&](Generators::PrefixCache& cache, std::vector<int32_t> tokens) {
+    std::vector<std::unique_ptr<OrtValue>> pasts(1);
+    return cache.Lookup(tokens, pasts, model->allocator_cpu_);
+  };
+
+  // A prompt that is a prefix of a later one is replaced by it
+  {
+    Generators::PrefixCache cache{1 << 10, 2};
+    Insert(cache, {1, 2});
+    Insert(cache, {1, 2, 3, 4});
+    EXPECT_EQ(cache.GetEntryCount(), 1);
+    EXPECT_EQ(cache.GetByteCount(), 4 * 8);
+    EXPECT_EQ(Lookup(cache, {1, 2, 5}), 2);
+    EXPECT_EQ(Lookup(cache, {1, 2, 3, 4, 5}), 4);
+  }
+
+  // Evicting a prompt keeps the prefix it shares with another one
+  {
+    Generators::PrefixCache cache{100, 2};
+    Insert(cache, {1, 2, 3, 4});
+    Insert(cache, {1, 2, 5, 6, 7, 8});
+    EXPECT_EQ(cache.GetEntryCount(), 2);
+    EXPECT_EQ(Lookup(cache, {1, 2, 3, 4, 0}), 4);  // Now the most recently used, so the longer prompt is evicted next
+    Insert(cache, {9, 9, 9, 9});
+    EXPECT_EQ(cache.GetEntryCount(), 2);
+    EXPECT_EQ(cache.GetByteCount(), 2 * 4 * 8);
+    EXPECT_EQ(Lookup(cache, {1, 2, 5, 6, 7, 8, 0}), 2);
+    EXPECT_EQ(Lookup(cache, {1, 2, 3, 4, 0}), 4);
+  }
+}
+
 TEST(ModelTests, BeamSearchGptFp32) {
   std::vector<int64_t> input_ids_shape{3, 12};
   std::vector<int32_t> input_ids{
@@ -106,6 +622,88 @@ TEST(ModelTests, BeamSearchGptFp32) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
   }
 }
+
+// Same as BeamSearchGptFp32, but the batch entries pick their top beams in parallel, which must not change the result
+TEST(ModelTests, BeamSearchThreadsGptFp32) {
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620, 131, 131, 131, 181, 638, 638, 638, 638,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572, 292, 292, 292, 292, 292, 292, 292, 292,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328, 328, 669, 669, 669, 669, 669, 669, 669};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 3;
+  params->sequence_length = 12;
+  params->input_ids = input_ids;
+  params->search.max_length = 20;
+  params->search.length_penalty = 1.0f;
+  params->search.num_beams = 4;
+  params->search.num_threads = 3;
+
+  Generators::BeamSearch_Cpu search{*params};
+  auto state = model->CreateState(search.sequence_lengths_, *params);
+
+  while (!search.IsDone()) {
+    search.SetLogits(state->Run(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices()));
+    search.ApplyMinLength(1);
+    search.ApplyRepetitionPenalty(1.0f);
+    search.SelectTop();
+  }
+
+  std::vector<int32_t> output_sequence(static_cast<size_t>(params->batch_size) * params->search.max_length);
+  search.Finalize(1, Generators::cpu_span<int32_t>{output_sequence}, {});
+  EXPECT_EQ(output_sequence, expected_output);
+}
+
+TEST(ModelTests, GroupBeamSearchGptFp32) {
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 52, 195, 731, 321, 301,
+      41, 554, 74, 622, 206, 222, 75, 223};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 2;
+  params->sequence_length = 8;
+  params->input_ids = input_ids;
+  params->search.max_length = 16;
+  params->search.num_beams = 4;
+  params->search.num_beam_groups = 2;
+  params->search.diversity_penalty = 1000.0f;  // Far beyond the logits, so a group never repeats an earlier one's token
+  params->search.num_return_sequences = 2;
+
+  Generators::BeamSearch_Cpu search{*params};
+  auto state = model->CreateState(search.sequence_lengths_, *params);
+
+  while (!search.IsDone()) {
+    search.SetLogits(state->Run(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices()));
+    search.SelectTop();
+
+    // Both groups are picked from the one forward pass, the second avoiding every token the first just picked
+    auto next_tokens = search.GetNextTokens().GetCPU();
+    for (size_t batch = 0; batch < 2; batch++) {
+      auto first_group = next_tokens.subspan(batch * 4, 2);
+      for (int32_t token : next_tokens.subspan(batch * 4 + 2, 2)) {
+        if (token != params->pad_token_id)
+          EXPECT_EQ(std::count(first_group.begin(), first_group.end(), token), 0) << "batch " << batch << " token " << token;
+      }
+    }
+  }
+
+  std::vector<int32_t> output_sequence(2 * 2 * params->search.max_length);
+  search.Finalize(2, Generators::cpu_span<int32_t>{output_sequence}, {});
+  for (size_t i = 0; i < output_sequence.size(); i += params->search.max_length) {
+    // The prompts come first, the best hypotheses of all groups are merged per batch entry
+    EXPECT_TRUE(std::equal(input_ids.begin() + (i / params->search.max_length / 2) * 8,
+                           input_ids.begin() + (i / params->search.max_length / 2 + 1) * 8, output_sequence.begin() + i));
+  }
+}
 #endif
 
 #if USE_CUDA
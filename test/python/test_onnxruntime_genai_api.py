@@ -63,6 +63,65 @@ def test_greedy_search(test_data_path, relative_model_path):
         assert sequences[i] == expected_sequence[i].tolist()
 
 
+@pytest.mark.parametrize(
+    "relative_model_path",
+    (
+        [
+            Path("hf-internal-testing") / "tiny-random-gpt2-fp32",
+        ]
+    ),
+)
+def test_append_tokens(test_data_path, relative_model_path):
+    model_path = os.fspath(Path(test_data_path) / relative_model_path)
+
+    model = og.Model(model_path)
+
+    search_params = og.GeneratorParams(model)
+    search_params.input_ids = np.array([0, 0, 0, 52], dtype=np.int32)
+    search_params.set_search_options(do_sample=False, max_length=20)
+
+    generator = og.Generator(model, search_params)
+    for _ in range(3):
+        generator.compute_logits()
+        generator.generate_next_token()
+    generator.append_tokens(np.array([195, 731], dtype=np.int32))
+    combined_ids = np.array(generator.get_sequence(0), dtype=np.int32)
+
+    while not generator.is_done():
+        generator.compute_logits()
+        generator.generate_next_token()
+
+    # Same as starting over from the combined sequence
+    combined_params = og.GeneratorParams(model)
+    combined_params.input_ids = combined_ids
+    combined_params.set_search_options(do_sample=False, max_length=20)
+    assert model.generate(combined_params)[0] == generator.get_sequence(0).tolist()
+
+
+@pytest.mark.parametrize(
+    "relative_model_path",
+    (
+        [
+            Path("hf-internal-testing") / "tiny-random-gpt2-fp32",
+        ]
+    ),
+)
+def test_speculative_decoding(test_data_path, relative_model_path):
+    model_path = os.fspath(Path(test_data_path) / relative_model_path)
+
+    model = og.Model(model_path)
+    draft_model = og.Model(model_path)
+
+    search_params = og.GeneratorParams(model)
+    search_params.input_ids = np.array([0, 0, 195, 731], dtype=np.int32)
+    search_params.set_search_options(do_sample=False, max_length=10, num_speculative_tokens=3)
+    search_params.set_draft_model(draft_model)
+
+    # Greedy speculative decoding gives the same output as the model alone
+    expected_sequence = [0, 0, 195, 731, 731, 114, 114, 114, 114, 114]
+    assert model.generate(search_params)[0] == expected_sequence
+
+
 # TODO: CUDA pipelines use python3.6 and do not have a way to download models since downloading models
 # requires pytorch and hf transformers. This test should be re-enabled once the pipeline is updated.
 @pytest.mark.skipif(
@@ -4,6 +4,8 @@
 #include <gtest/gtest.h>
 #include <generators.h>
 #include <search.h>
+#include <softmax.h>
+#include <beam_search_scorer.h>
 #include <models/model.h>
 #include <iostream>
 #include <random>
@@ -76,6 +78,44 @@ TEST(SamplingTests, BatchedSamplingTopKCpu) {
   }
 }
 
+TEST(SamplingTests, SamplingTopKPadsAfterEOSCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0, 1};
+  // Row 0 picks the EOS token on the first step, so must get the pad token on the second
+  std::vector<float> first_logits{0.0f, 100.0f, 0.0f, 0.0f, 0.0f,
+                                  0.0f, 0.0f, 100.0f, 0.0f, 0.0f};
+  std::vector<float> second_logits{0.0f, 0.0f, 0.0f, 100.0f, 0.0f,
+                                   0.0f, 0.0f, 0.0f, 100.0f, 0.0f};
+  int vocab_size = 5;
+  int batch_size = 2;
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.do_sample = true;
+  params->search.top_k = 2;
+  params->batch_size = batch_size;
+  params->sequence_length = 1;
+  params->vocab_size = vocab_size;
+  params->input_ids = input_ids;
+  params->eos_token_id = 1;
+  params->pad_token_id = 4;
+  params->device_type = Generators::DeviceType::CPU;
+  auto generator = Generators::CreateGenerator(*model, *params);
+
+  generator->search_->SetLogits(Generators::cpu_span<float>(first_logits));
+  generator->computed_logits_ = true;
+  generator->GenerateNextToken();
+  auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+  EXPECT_EQ(next_tokens[0], 1);
+  EXPECT_EQ(next_tokens[1], 2);
+
+  generator->search_->SetLogits(Generators::cpu_span<float>(second_logits));
+  generator->computed_logits_ = true;
+  generator->GenerateNextToken();
+  next_tokens = generator->search_->GetNextTokens().GetCPU();
+  EXPECT_EQ(next_tokens[0], 4);
+  EXPECT_EQ(next_tokens[1], 3);
+}
+
 TEST(SamplingTests, BatchedSamplingTopPAndKCpu) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   std::vector<int32_t> input_ids{0, 1, 2, 3};
@@ -131,6 +171,187 @@ void CreateRandomLogits(float* logits, int num_large, int vocab_size, int batch_
   }
 }
 
+// Both rows have the same logits and have already seen token 0, but only the second row penalizes repeating it
+TEST(SamplingTests, PerRowSearchOptionsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0, 0};
+  std::vector<int32_t> expected_output{0, 1};
+  std::vector<float> logits_cpu{2.0f, 1.9f, 0.1f, 0.1f, 0.1f,
+                                2.0f, 1.9f, 0.1f, 0.1f, 0.1f};
+  int vocab_size = 5;
+  int batch_size = 2;
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = batch_size;
+  params->sequence_length = 1;
+  params->vocab_size = vocab_size;
+  params->input_ids = input_ids;
+  params->row_search.resize(batch_size, params->search);
+  params->row_search[1].repetition_penalty = 2.0f;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->search_->SetLogits(Generators::cpu_span<float>(logits_cpu));
+  generator->search_->ApplyRepetitionPenalty(params->search.repetition_penalty);
+  generator->computed_logits_ = true;
+  generator->GenerateNextToken();
+  auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), next_tokens.data(), expected_output.size() * sizeof(int32_t)));
+}
+
+TEST(SamplingTests, SoftMaxCpu) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist{0.0f, 5.0f};
+  // Sizes that exercise the vector loops, their tails, and both together
+  for (size_t size : {1, 7, 8, 15, 16, 17, 1000, 32000}) {
+    std::vector<float> values(size);
+    for (auto& v : values)
+      v = dist(engine);
+
+    float temperature = 0.7f;
+    float max = *std::max_element(values.begin(), values.end());
+    std::vector<double> expected(size);
+    double sum = 0.0;
+    for (size_t i = 0; i < size; i++)
+      sum += expected[i] = std::exp((values[i] - max) / temperature);
+
+    auto log_values = values;
+    Generators::softmax(values, temperature);
+    for (size_t i = 0; i < size; i++)
+      EXPECT_NEAR(values[i], expected[i] / sum, 1e-5 * expected[i] / sum + 1e-12);
+
+    Generators::log_softmax(log_values);
+    EXPECT_NEAR(std::accumulate(log_values.begin(), log_values.end(), 0.0, [](double total, float v) { return total + std::exp(v); }), 1.0, 1e-4);
+  }
+
+  // Banned tokens, set to lowest() or -inf, must get exactly no probability in the vector loops and their tails
+  for (size_t size : {3, 17, 40}) {
+    std::vector<float> values(size, 1.0f);
+    for (size_t i = 0; i < size; i += 3)
+      values[i] = i % 2 ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::lowest();
+    values[1] = 2.0f;
+
+    Generators::softmax(values, 0.7f);
+    for (size_t i = 0; i < size; i += 3)
+      EXPECT_EQ(values[i], 0.0f) << "size " << size << " index " << i;
+    EXPECT_NEAR(std::accumulate(values.begin(), values.end(), 0.0), 1.0, 1e-5);
+  }
+}
+
+TEST(SamplingTests, Float16ConversionCpu) {
+  // Every finite fp16 value, then sizes that exercise the vector loops, their tails, and both together
+  std::vector<uint16_t> all_fp16;
+  for (uint32_t v = 0; v <= 0xFFFF; v++) {
+    if ((v & 0x7C00) != 0x7C00)
+      all_fp16.push_back(static_cast<uint16_t>(v));
+  }
+
+  for (size_t size : {all_fp16.size(), size_t{1}, size_t{7}, size_t{8}, size_t{15}, size_t{16}, size_t{17}}) {
+    std::span<const uint16_t> fp16{all_fp16.data() + all_fp16.size() - size, size};
+    std::vector<float> fp32(size);
+    Generators::FastFloat16ToFloat32(fp16, fp32);
+    for (size_t i = 0; i < size; i++)
+      ASSERT_EQ(fp32[i], Generators::Float16ToFloat32(fp16[i]));
+
+    std::vector<uint16_t> round_trip(size);
+    Generators::FastFloat32ToFloat16(fp32, round_trip);
+    for (size_t i = 0; i < size; i++)
+      ASSERT_EQ(round_trip[i], fp16[i]);
+
+    // bfloat16 keeps the top half of a float, so these are exact
+    std::vector<uint16_t> bf16(size);
+    std::vector<float> bf16_fp32(size);
+    Generators::Float32ToBFloat16(fp32, bf16);
+    Generators::BFloat16ToFloat32(bf16, bf16_fp32);
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(bf16[i], Generators::Float32ToBFloat16(fp32[i]));
+      ASSERT_EQ(bf16_fp32[i], Generators::BFloat16ToFloat32(bf16[i]));
+    }
+  }
+
+  // bfloat16 rounds to nearest even
+  EXPECT_EQ(Generators::Float32ToBFloat16(1.00390625f), 0x3F80);  // Halfway, stays even
+  EXPECT_EQ(Generators::Float32ToBFloat16(1.01171875f), 0x3F82);  // Halfway, rounds up to even
+  EXPECT_EQ(Generators::Float32ToBFloat16(1.0048828125f), 0x3F81);
+}
+
+TEST(SamplingTests, RepetitionPenaltyAcrossStepsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0};
+  // Each step's best token was generated by an earlier step, so the penalty must include the tokens appended since
+  std::vector<std::vector<float>> step_logits{{0.0f, 2.0f, 1.5f, 1.0f, 0.5f},
+                                              {0.0f, 2.0f, 1.5f, 1.0f, 0.5f},
+                                              {0.0f, 2.0f, 1.8f, 1.5f, 0.5f}};
+  std::vector<int32_t> expected_tokens{1, 2, 3};
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->search.repetition_penalty = 2.0f;
+  params->batch_size = 1;
+  params->sequence_length = 1;
+  params->vocab_size = 5;
+  params->input_ids = input_ids;
+  params->eos_token_id = 4;
+  params->device_type = Generators::DeviceType::CPU;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  for (size_t step = 0; step < step_logits.size(); step++) {
+    generator->search_->SetLogits(Generators::cpu_span<float>(step_logits[step]));
+    generator->search_->ApplyRepetitionPenalty(params->search.repetition_penalty);
+    generator->computed_logits_ = true;
+    generator->GenerateNextToken();
+    EXPECT_EQ(generator->search_->GetNextTokens().GetCPU()[0], expected_tokens[step]);
+  }
+}
+
+TEST(SamplingTests, BeamSequencesCpu) {
+  // One batch entry of 3 beams, every step reshuffling which beam continues which
+  std::vector<int32_t> input_ids{7, 8};
+  std::vector<std::vector<int32_t>> step_beams{{0, 0, 0}, {2, 0, 1}, {1, 1, 0}, {2, 2, 2}};
+  std::vector<std::vector<int32_t>> step_tokens{{10, 11, 12}, {20, 21, 22}, {30, 31, 32}, {40, 41, 42}};
+
+  Generators::Sequences sequences{input_ids, 1, 3, 10};
+  std::vector<std::vector<int32_t>> expected(3, input_ids);
+  for (size_t step = 0; step < step_beams.size(); step++) {
+    auto previous = expected;
+    for (size_t beam = 0; beam < 3; beam++) {
+      expected[beam] = previous[step_beams[step][beam]];
+      expected[beam].push_back(step_tokens[step][beam]);
+    }
+    sequences.AppendNextTokenToSequences(step_beams[step], step_tokens[step]);
+
+    // Only some beams are asked for on each step, so the others have to catch up over several steps at once
+    for (size_t beam = step % 2; beam < 3; beam += 2) {
+      auto sequence = sequences.GetSequence(static_cast<int>(beam));
+      EXPECT_EQ(std::vector<int32_t>(sequence.begin(), sequence.end()), expected[beam]) << "step " << step << " beam " << beam;
+    }
+  }
+
+  for (size_t beam = 0; beam < 3; beam++) {
+    auto sequence = sequences.GetSequence(static_cast<int>(beam));
+    EXPECT_EQ(std::vector<int32_t>(sequence.begin(), sequence.end()), expected[beam]) << "beam " << beam;
+  }
+}
+
+TEST(SamplingTests, BeamHypothesesCpu) {
+  // Two entries sharing storage for hypotheses up to 4 tokens, every better hypothesis taking the worst one's storage
+  std::vector<int32_t> storage(2 * 4);
+  std::vector<Generators::HypothesisScore> beams(2);
+  beams[0].buffer = std::span<int32_t>{storage}.subspan(0, 4);
+  beams[1].buffer = std::span<int32_t>{storage}.subspan(4, 4);
+  Generators::BeamHypotheses hypotheses;
+  hypotheses.Init(1.0f, beams);
+
+  hypotheses.Add(std::vector<int32_t>{1, 2}, -4.0f);        // Score -2
+  hypotheses.Add(std::vector<int32_t>{3, 4, 5}, -3.0f);     // Score -1
+  hypotheses.Add(std::vector<int32_t>{6, 7, 8, 9}, -2.0f);  // Score -0.5, replaces {1, 2}
+  hypotheses.Add(std::vector<int32_t>{1, 1}, -8.0f);        // Score -4, too low to get in
+
+  ASSERT_EQ(hypotheses.beams_used_, 2);
+  auto best = hypotheses.beams_[0].Hypothesis();
+  auto second = hypotheses.beams_[1].Hypothesis();
+  EXPECT_EQ(std::vector<int32_t>(best.begin(), best.end()), (std::vector<int32_t>{6, 7, 8, 9}));
+  EXPECT_EQ(std::vector<int32_t>(second.begin(), second.end()), (std::vector<int32_t>{3, 4, 5}));
+  EXPECT_EQ(hypotheses.beams_[0].score, -0.5f);
+  EXPECT_EQ(hypotheses.beams_[1].score, -1.0f);
+}
+
 TEST(SamplingTests, RandomizedSamplingTopPCpu) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   int vocab_size = 32000;  // vocab size of llama
@@ -206,6 +427,87 @@ TEST(SamplingTests, RandomizedSamplingTopKCpu) {
   }
 }
 
+TEST(SamplingTests, ParallelSamplingTopPCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  int vocab_size = 32000;  // vocab size of llama
+  int batch_size = 16;
+  std::vector<int32_t> input_ids(batch_size);
+  std::vector<float> logits_cpu(vocab_size * batch_size);
+  std::mt19937 engine{0};
+  CreateRandomLogits(logits_cpu.data(), 10, vocab_size, batch_size, engine);
+
+  // Each row's draws are keyed by its seed, row and step, so the tokens can't depend on how many threads share the rows
+  std::vector<int32_t> expected_tokens;
+  for (int num_threads : {1, 2, 4, 0}) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.do_sample = true;
+    params->search.top_p = 0.95f;
+    params->search.random_seed = 42;
+    params->search.num_threads = num_threads;
+    params->batch_size = batch_size;
+    params->sequence_length = 1;
+    params->vocab_size = vocab_size;
+    params->input_ids = input_ids;
+    params->device_type = Generators::DeviceType::CPU;
+    auto generator = Generators::CreateGenerator(*model, *params);
+    auto logits_copy = logits_cpu;
+    generator->search_->SetLogits(Generators::cpu_span<float>(logits_copy));
+    generator->computed_logits_ = true;
+    generator->GenerateNextToken();
+    auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+    for (int b = 0; b < batch_size; b++)
+      EXPECT_EQ(logits_cpu[next_tokens[b] + vocab_size * b], 25.0f);
+
+    if (expected_tokens.empty())
+      expected_tokens.assign(next_tokens.begin(), next_tokens.end());
+    else
+      EXPECT_TRUE(std::equal(expected_tokens.begin(), expected_tokens.end(), next_tokens.begin()));
+  }
+}
+
+TEST(SamplingTests, SamplingIndependentOfOtherRowsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  int vocab_size = 32000;  // vocab size of llama
+  int batch_size = 2;
+  std::vector<int32_t> input_ids(batch_size);
+  std::vector<float> logits_cpu(vocab_size * batch_size);
+  std::mt19937 engine{0};
+  CreateRandomLogits(logits_cpu.data(), 20, vocab_size, batch_size, engine);
+
+  // Row 0 hits EOS on the first step or not, which changes whether it samples on the second. Row 1's second token
+  // must come out the same either way.
+  std::vector<int32_t> second_tokens;
+  for (int32_t first_token : {5, 6}) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.do_sample = true;
+    params->search.top_k = 20;
+    params->search.random_seed = 7;
+    params->batch_size = batch_size;
+    params->sequence_length = 1;
+    params->vocab_size = vocab_size;
+    params->input_ids = input_ids;
+    params->eos_token_id = 5;
+    params->device_type = Generators::DeviceType::CPU;
+    auto generator = Generators::CreateGenerator(*model, *params);
+
+    auto logits_copy = logits_cpu;
+    std::fill(logits_copy.begin(), logits_copy.begin() + vocab_size, 0.0f);
+    logits_copy[first_token] = 100.0f;
+    generator->search_->SetLogits(Generators::cpu_span<float>(logits_copy));
+    generator->computed_logits_ = true;
+    generator->GenerateNextToken();
+
+    logits_copy = logits_cpu;
+    generator->search_->SetLogits(Generators::cpu_span<float>(logits_copy));
+    generator->computed_logits_ = true;
+    generator->GenerateNextToken();
+    second_tokens.push_back(generator->search_->GetNextTokens().GetCPU()[1]);
+  }
+  EXPECT_EQ(second_tokens[0], second_tokens[1]);
+}
+
 TEST(SamplingTests, RandomizedSamplingTopPAndKCpu) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   int vocab_size = 32000;  // vocab size of llama